@@ -0,0 +1,108 @@
+#ifndef COMBINING_H
+#define COMBINING_H
+
+#include <cstddef>
+#include <atomic>
+#include <sched.h>
+
+#include "Common.h"
+
+namespace dt {
+
+    // publication slots of one segment; threads beyond that share them
+    const size_t combineSlots = 32;
+    // passes a combiner makes over the slots before it lets go of the lock
+    const int combinePasses = 4;
+    // failed try-locks before a waiting writer blocks on the lock instead
+    const int combineSpins = 1024;
+
+    enum CombineOp {
+        CombinePut,
+        CombineRemove
+    };
+
+    // One published write. The caller waits for it, so the key and value
+    // stay on its stack and the slot only points at them.
+    template <typename K, typename V>
+    struct CombineSlot {
+        enum State {
+            Free,
+            // being filled in by the thread that claimed it
+            Claimed,
+            Pending,
+            Done
+        };
+
+        std::atomic<int>    state;
+        CombineOp           op;
+        unsigned long       hash;
+        const K *           key;
+        const V *           value;
+        bool                result;
+        // keeps the slots of two threads off the same cache line
+        char                padding[64];
+
+        CombineSlot() : state(Free), op(CombinePut), hash(0), key(NULL), value(NULL), result(false) {}
+    };
+
+    // Index a thread starts probing the publication slots from, handed out
+    // round robin so that threads mostly keep a slot of their own.
+    inline size_t combineHint()
+    {
+        static std::atomic<size_t> next(0);
+        static thread_local size_t hint = next.fetch_add(1, std::memory_order_relaxed);
+        return hint;
+    }
+
+    // Publication list of flat combining for one segment. A writer claims a
+    // slot, publishes its operation there and then either wins the segment
+    // lock and applies every pending slot in one pass (the combiner), or
+    // waits for a combiner to mark its slot done. Hashtable runs the
+    // passes; this class only holds the slots.
+    template <typename K, typename V>
+    class CombineQueue : noncopyable {
+        public :
+            typedef CombineSlot<K, V> Slot;
+
+            Slot * publish(CombineOp op, unsigned long hashValue, const K * key, const V * value)
+            {
+                Slot * slot = claim();
+                slot->op = op;
+                slot->hash = hashValue;
+                slot->key = key;
+                slot->value = value;
+                slot->state.store(Slot::Pending, std::memory_order_release);
+                return slot;
+            }
+
+            // Hands the result of a done slot back and frees the slot.
+            bool release(Slot * slot)
+            {
+                bool result = slot->result;
+                slot->state.store(Slot::Free, std::memory_order_release);
+                return result;
+            }
+
+            Slot & operator[](size_t i)
+            {
+                return slots[i];
+            }
+
+        private :
+            Slot slots[combineSlots];
+
+            Slot * claim()
+            {
+                for (size_t i = combineHint(); ; i++) {
+                    Slot & slot = slots[i % combineSlots];
+                    int expected = Slot::Free;
+                    if (slot.state.load(std::memory_order_relaxed) == Slot::Free
+                        && slot.state.compare_exchange_strong(expected, Slot::Claimed, std::memory_order_acquire))
+                        return &slot;
+                    if (i % combineSlots == combineSlots - 1)
+                        sched_yield();
+                }
+            }
+    };
+}
+#endif // COMBINING_H
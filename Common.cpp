@@ -1,20 +1,62 @@
+
 #include "Common.h"
 
+#include <atomic>
+#include <pthread.h>
+#include <unistd.h>
+
+static dt::timemilliseconds readClock(clockid_t id)
+{
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return (dt::timemilliseconds) ts.tv_sec * 1000ll + ts.tv_nsec / 1000000;
+}
+
 dt::timemilliseconds dt::getMilliseconds() {
-           /* Example of timestamp in second. */
-            time_t timestamp_sec; /* timestamp in second */
-            time(&timestamp_sec);  /* get current time; same as: timestamp_sec = time(NULL)  */
-           
-            /* Example of timestamp in millisecond. */
-            struct timeb timer_msec;
-            timemilliseconds timestamp_msec; /* timestamp in millisecond. */
-            if (!ftime(&timer_msec)) {
-                timestamp_msec = ((long long int) timer_msec.time) * 1000ll + 
-                                    (long long int) timer_msec.millitm;
-            }
-            else {
-                timestamp_msec = -1;
-            }
-            printf ("%lld milliseconds since epoch\n", timestamp_msec);
-            return  timestamp_msec;
-} 
+    return readClock(CLOCK_REALTIME);
+}
+
+dt::timemilliseconds dt::monotonicMilliseconds() {
+    return readClock(CLOCK_MONOTONIC);
+}
+
+long long dt::monotonicNanoseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+dt::timemilliseconds dt::coarseMilliseconds() {
+#ifdef CLOCK_MONOTONIC_COARSE
+    return readClock(CLOCK_MONOTONIC_COARSE);
+#else
+    return readClock(CLOCK_MONOTONIC);
+#endif
+}
+
+namespace {
+    std::atomic<dt::timemilliseconds> cachedNow(0);
+    pthread_once_t tickerOnce = PTHREAD_ONCE_INIT;
+
+    void * tick(void *)
+    {
+        while (true) {
+            cachedNow.store(dt::monotonicMilliseconds(), std::memory_order_relaxed);
+            usleep(1000);
+        }
+        return NULL;
+    }
+
+    void startTicker()
+    {
+        cachedNow.store(dt::monotonicMilliseconds(), std::memory_order_relaxed);
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, tick, NULL) == 0)
+            pthread_detach(thread);
+    }
+}
+
+dt::timemilliseconds dt::cachedMilliseconds() {
+    pthread_once(&tickerOnce, startTicker);
+    return cachedNow.load(std::memory_order_relaxed);
+}
@@ -2,9 +2,7 @@
 #define COMMON_H
 
 #include <stdio.h>      /* printf */
-#include <time.h>       /* time_t, time (for timestamp in second) */
-#include <sys/timeb.h>  /* ftime, timeb (for timestamp in millisecond) */
-#include <sys/time.h>   /* gettimeofday, timeval (for timestamp in microsecond) */
+#include <time.h>       /* clock_gettime */
 
 
 namespace dt { 
@@ -24,7 +22,26 @@ namespace dt {
         TypeName(const TypeName&) ;      \
         void operator=(const TypeName&);
         
+        // wall clock, milliseconds since the epoch
         timemilliseconds getMilliseconds();
 
+        // Time sources a Hashtable can stamp its entries with; all of them
+        // only ever move forward.
+        typedef timemilliseconds (*TimeSource)();
+
+        // CLOCK_MONOTONIC
+        timemilliseconds monotonicMilliseconds();
+
+        // CLOCK_MONOTONIC in nanoseconds, for timing short operations
+        long long monotonicNanoseconds();
+
+        // CLOCK_MONOTONIC_COARSE: a vDSO read of the last kernel tick, a few
+        // nanoseconds per call with one to four milliseconds of resolution
+        timemilliseconds coarseMilliseconds();
+
+        // CLOCK_MONOTONIC as last stored by a ticker thread refreshing it
+        // every millisecond: one relaxed load per call
+        timemilliseconds cachedMilliseconds();
+
 }
 #endif // COMMON_H
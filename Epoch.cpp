@@ -0,0 +1,134 @@
+
+#include "Epoch.h"
+
+namespace {
+    // how many retirements a thread makes between two collection attempts
+    const size_t collectInterval = 64;
+
+    // set once the manager is destroyed at process exit; threads that exit
+    // later, such as the timer thread, then have no record left to release
+    bool managerDestroyed = false;
+}
+
+thread_local dt::EpochRecord * dt::EpochManager::current = NULL;
+
+namespace dt {
+    // Releases the calling thread's record when the thread exits.
+    struct EpochThreadExit {
+        EpochRecord * rec;
+
+        EpochThreadExit() : rec(NULL) {}
+
+        ~EpochThreadExit() {
+            if (rec != NULL && !managerDestroyed)
+                EpochManager::getInstance().unregisterThread(rec);
+        }
+    };
+}
+
+static thread_local dt::EpochThreadExit threadExit;
+
+dt::EpochRecord * dt::EpochManager::registerThread()
+{
+    EpochRecord * rec = NULL;
+    // reuse the record of a thread that has exited
+    for (EpochRecord * r = records.load(std::memory_order_acquire); r != NULL; r = r->next) {
+        bool expected = false;
+        if (r->inUse.compare_exchange_strong(expected, true)) {
+            rec = r;
+            break;
+        }
+    }
+
+    if (rec == NULL) {
+        rec = new EpochRecord();
+        EpochRecord * head = records.load(std::memory_order_relaxed);
+        do {
+            rec->next = head;
+        } while (!records.compare_exchange_weak(head, rec, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    current = rec;
+    threadExit.rec = rec;
+    return rec;
+}
+
+void dt::EpochManager::unregisterThread(EpochRecord * rec)
+{
+    rec->state.store(0, std::memory_order_release);
+    if (!rec->retired.empty()) {
+        Lock lock(&orphanMutex);
+        orphans.insert(orphans.end(), rec->retired.begin(), rec->retired.end());
+        rec->retired.clear();
+    }
+    rec->depth = 0;
+    rec->sinceCollect = 0;
+    current = NULL;
+    rec->inUse.store(false, std::memory_order_release);
+}
+
+void dt::EpochManager::retire(void * p, void (*reclaimFunc)(void *))
+{
+    EpochRecord * rec = record();
+    RetiredPointer r;
+    r.ptr = p;
+    r.reclaim = reclaimFunc;
+    r.epoch = globalEpoch.load(std::memory_order_seq_cst);
+    rec->retired.push_back(r);
+
+    if (++rec->sinceCollect >= collectInterval) {
+        rec->sinceCollect = 0;
+        collect();
+    }
+}
+
+bool dt::EpochManager::tryAdvance()
+{
+    uint64_t e = globalEpoch.load(std::memory_order_seq_cst);
+    for (EpochRecord * r = records.load(std::memory_order_acquire); r != NULL; r = r->next) {
+        uint64_t s = r->state.load(std::memory_order_seq_cst);
+        if ((s & 1) && (s >> 1) != e)
+            return false;
+    }
+    return globalEpoch.compare_exchange_strong(e, e + 1);
+}
+
+void dt::EpochManager::reclaim(std::vector<RetiredPointer> & list, uint64_t safeEpoch)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < list.size(); i++) {
+        if (list[i].epoch + 2 <= safeEpoch) {
+            list[i].reclaim(list[i].ptr);
+        } else {
+            list[kept++] = list[i];
+        }
+    }
+    list.resize(kept);
+}
+
+void dt::EpochManager::collect()
+{
+    tryAdvance();
+    uint64_t e = globalEpoch.load(std::memory_order_seq_cst);
+
+    reclaim(record()->retired, e);
+
+    Lock lock(&orphanMutex);
+    reclaim(orphans, e);
+}
+
+dt::EpochManager::~EpochManager()
+{
+    // process teardown: no reader can be left
+    managerDestroyed = true;
+    for (size_t i = 0; i < orphans.size(); i++)
+        orphans[i].reclaim(orphans[i].ptr);
+    EpochRecord * r = records.load();
+    while (r != NULL) {
+        EpochRecord * next = r->next;
+        for (size_t i = 0; i < r->retired.size(); i++)
+            r->retired[i].reclaim(r->retired[i].ptr);
+        delete r;
+        r = next;
+    }
+}
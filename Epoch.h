@@ -0,0 +1,139 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+#include "Common.h"
+#include "Threads.h"
+
+namespace dt {
+
+    // A pointer unlinked from a shared structure, waiting until no reader can
+    // still hold it.
+    struct RetiredPointer {
+        void *   ptr;
+        void     (*reclaim)(void *);
+        uint64_t epoch;
+    };
+
+    // Per-thread announcement of the epoch a reader is running in.
+    struct EpochRecord {
+        // (epoch << 1) | 1 while inside a critical section, 0 otherwise
+        std::atomic<uint64_t>       state;
+        std::atomic<bool>           inUse;
+        EpochRecord *               next;
+        int                         depth;
+        size_t                      sinceCollect;
+        std::vector<RetiredPointer> retired;
+        // keeps the state of two threads off the same cache line
+        char                        padding[64];
+
+        EpochRecord() : state(0), inUse(true), next(NULL), depth(0), sinceCollect(0) {}
+    };
+
+    // Epoch-based memory reclamation shared by every table in the process.
+    // Readers bracket their lock-free traversals with an EpochGuard; writers
+    // hand unlinked nodes to retire() instead of deleting them. A retired
+    // pointer is reclaimed once the global epoch has advanced twice past the
+    // epoch it was retired in, which proves that every reader that could have
+    // seen it has left its critical section.
+    class EpochManager : noncopyable {
+        public :
+            static EpochManager & getInstance()
+            {
+                static EpochManager INSTANCE;
+                return INSTANCE;
+            }
+
+            void enter()
+            {
+                EpochRecord * rec = record();
+                if (rec->depth++ == 0) {
+                    uint64_t e = globalEpoch.load(std::memory_order_relaxed);
+                    rec->state.store((e << 1) | 1, std::memory_order_seq_cst);
+                }
+            }
+
+            void exit()
+            {
+                EpochRecord * rec = record();
+                if (--rec->depth == 0) {
+                    rec->state.store(0, std::memory_order_release);
+                }
+            }
+
+            template <typename T>
+            void retire(T * p)
+            {
+                retire(p, &EpochManager::destroy<T>);
+            }
+
+            template <typename T>
+            void retireArray(T * p)
+            {
+                retire(p, &EpochManager::destroyArray<T>);
+            }
+
+            void retire(void * p, void (*reclaim)(void *));
+
+            // Tries to advance the epoch and frees whatever the calling
+            // thread retired that is now unreachable.
+            void collect();
+
+            ~EpochManager();
+
+        private :
+            std::atomic<uint64_t>       globalEpoch;
+            std::atomic<EpochRecord *>  records;
+            Mutex                       orphanMutex;
+            // retired by threads that exited before it became reclaimable
+            std::vector<RetiredPointer> orphans;
+
+            static thread_local EpochRecord * current;
+
+            EpochManager() : globalEpoch(1), records(NULL) {}
+
+            EpochRecord * record()
+            {
+                EpochRecord * rec = current;
+                if (rec == NULL)
+                    rec = registerThread();
+                return rec;
+            }
+
+            EpochRecord * registerThread();
+            bool tryAdvance();
+            void reclaim(std::vector<RetiredPointer> & list, uint64_t safeEpoch);
+
+            friend struct EpochThreadExit;
+            void unregisterThread(EpochRecord * rec);
+
+            template <typename T>
+            static void destroy(void * p)
+            {
+                delete static_cast<T *>(p);
+            }
+
+            template <typename T>
+            static void destroyArray(void * p)
+            {
+                delete [] static_cast<T *>(p);
+            }
+    };
+
+    // Scoped read-side critical section.
+    class EpochGuard : noncopyable {
+        public :
+            EpochGuard() {
+                EpochManager::getInstance().enter();
+            }
+
+            ~EpochGuard() {
+                EpochManager::getInstance().exit();
+            }
+    };
+}
+#endif // EPOCH_H
@@ -0,0 +1,1008 @@
+#ifndef FLATSEGMENT_H
+#define FLATSEGMENT_H
+
+#include <cstddef>
+#include <atomic>
+#include <iterator>
+#include <new>
+#include <type_traits>
+#include <vector>
+#include <utility>
+#include <string.h>
+#include <stdint.h>
+#include <sched.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "Common.h"
+#include "Threads.h"
+#include "Epoch.h"
+#include "HashSegment.h"
+#include "TimingWheel.h"
+
+namespace dt {
+
+    // Control byte of one slot. A full slot stores the low seven bits of its
+    // hash (0..127); the special values are all negative.
+    namespace ctrl {
+        const int8_t Empty   = -128;
+        const int8_t Deleted = -2;
+    }
+
+    // Sixteen control bytes probed together, with one SSE2 compare when the
+    // target has it and a scalar loop otherwise. Bit i of every mask stands
+    // for slot i of the group.
+    struct ControlGroup {
+        static const size_t width = 16;
+
+#if defined(__SSE2__)
+        __m128i bytes;
+
+        explicit ControlGroup(const int8_t * pos) : bytes(_mm_loadu_si128(reinterpret_cast<const __m128i *>(pos))) {}
+
+        unsigned match(int8_t h2) const
+        {
+            return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), bytes));
+        }
+
+        unsigned matchEmpty() const
+        {
+            return match(ctrl::Empty);
+        }
+
+        unsigned matchEmptyOrDeleted() const
+        {
+            // Empty and Deleted are the only control bytes below -1
+            return _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-1), bytes));
+        }
+#else
+        const int8_t * bytes;
+
+        explicit ControlGroup(const int8_t * pos) : bytes(pos) {}
+
+        unsigned match(int8_t h2) const
+        {
+            unsigned mask = 0;
+            for (size_t i = 0; i < width; i++) {
+                if (bytes[i] == h2)
+                    mask |= 1u << i;
+            }
+            return mask;
+        }
+
+        unsigned matchEmpty() const
+        {
+            return match(ctrl::Empty);
+        }
+
+        unsigned matchEmptyOrDeleted() const
+        {
+            unsigned mask = 0;
+            for (size_t i = 0; i < width; i++) {
+                if (bytes[i] < -1)
+                    mask |= 1u << i;
+            }
+            return mask;
+        }
+#endif
+    };
+
+    // Bytes of a T copied out of a slot that a writer may be changing at the
+    // same time; they are only looked at as a T once the copy is known to
+    // be consistent.
+    template <typename T>
+    struct RacyCopy {
+        alignas(T) unsigned char bytes[sizeof(T)];
+
+        void load(const T & from)
+        {
+            memcpy(bytes, static_cast<const void *>(&from), sizeof(T));
+        }
+
+        const T & get() const
+        {
+            return *reinterpret_cast<const T *>(bytes);
+        }
+    };
+
+    // Open-addressing segment in the style of Swiss tables: keys, values and
+    // timestamps live inline in one flat slot array, and a parallel array of
+    // one-byte control words is probed sixteen slots at a time. A lookup
+    // usually costs one control group load and one slot load.
+    //
+    // It offers the same interface as HashSegment, with two differences:
+    // get() and contain() run under the segment read lock, and a resize
+    // moves every entry at once when the segment doubles (or shrinks),
+    // instead of moving a few buckets per write. The "buckets" seen by iteration are the
+    // control groups.
+    //
+    // With trivially copyable keys and values the segment also supports
+    // ReadOptimistic mode, a seqlock: writers make a sequence counter odd
+    // for the length of every change, and get(), visit() and contain()
+    // copy the entry out without any lock, keeping the copy only if the
+    // sequence was even and unchanged around it. The arrays are reached
+    // through a published descriptor and retired through the EpochManager
+    // on resize, so a reader racing a resize reads stale memory, never
+    // freed memory.
+    template <typename K, typename V, typename F>
+    class FlatSegment : noncopyable
+    {
+    public:
+        static const bool lockFreeReads = false;
+        static const bool optimisticReads = std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value;
+        static const bool timed = true;
+
+        // slots live inline in one array per segment; there is no node allocator
+        static SlabStats allocatorStats()
+        {
+            SlabStats s;
+            s.blockSize = sizeof(Slot);
+            return s;
+        }
+
+        FlatSegment() : mutex(NULL), m_size(0), loadFactor(defaultLoadFactor), capacity(0), minCapacity(0), autoShrink(false), growthLeft(0), ctrlBytes(NULL), slots(NULL), wheel(NULL), sliding(false),
+            refBits(NULL), maxEntries(0), maxBytes(0), bytes(0), weigher(NULL), keepEvicted(false), clockHand(0), evictionCount(0),
+            optimistic(false), sequence(0), published(NULL)
+        {
+        }
+
+        ~FlatSegment()
+        {
+            if (slots != NULL) {
+                destroySlots();
+                ::operator delete(slots);
+                delete [] ctrlBytes;
+            }
+            delete [] refBits;
+            delete published.load(std::memory_order_relaxed);
+            delete wheel;
+            delete mutex;
+        }
+
+        // Same contract as HashSegment::init().
+        void init(size_t initCapacity, float factor, ReadMode mode, bool shrink, bool slide)
+        {
+            mutex = new ReadWriteMutex();
+            sliding = slide;
+            optimistic = optimisticReads && mode == ReadOptimistic;
+            // a flat table cannot go beyond 7/8 full without long probes
+            loadFactor = factor < 0.875f ? factor : 0.875f;
+            minCapacity = capacityFor(initCapacity);
+            autoShrink = shrink;
+            allocate(minCapacity);
+            publish();
+        }
+
+        // Same contract as HashSegment::trackDeadlines().
+        void trackDeadlines(const timemilliseconds & now)
+        {
+            if (wheel == NULL)
+                wheel = new TimingWheel<ExpiryRecord<K> >(now);
+        }
+
+        // Same contract as HashSegment::bound(). The access bits live in an
+        // array of their own, next to the control bytes.
+        void bound(size_t entries, size_t byteLimit, size_t (* w)(const K &, const V &), bool keep)
+        {
+            maxEntries = entries;
+            maxBytes = byteLimit;
+            weigher = w;
+            keepEvicted = keep;
+            if (bounded() && refBits == NULL) {
+                refBits = newRefBits(capacity);
+                publish();
+            }
+        }
+
+        void takeEvicted(std::vector<std::pair<K, V> > & out)
+        {
+            if (!evicted.empty()) {
+                out.insert(out.end(), std::make_move_iterator(evicted.begin()), std::make_move_iterator(evicted.end()));
+                evicted.clear();
+            }
+        }
+
+        size_t evictions() const
+        {
+            return evictionCount;
+        }
+
+        // Written under the write lock only, but readable without any lock,
+        // as Hashtable::size() adds the segments up without locking.
+        size_t size() const
+        {
+            return m_size.load(std::memory_order_relaxed);
+        }
+
+        size_t bucketCount() const
+        {
+            return capacity / ControlGroup::width;
+        }
+
+        template <typename Visitor>
+        void visitBucket(size_t index, Visitor & visitor) const
+        {
+            size_t base = index * ControlGroup::width;
+            for (size_t i = 0; i < ControlGroup::width; i++) {
+                if (ctrlBytes[base + i] >= 0) {
+                    const Slot & slot = slots[base + i];
+                    visitor(slot.key, slot.value, slot.deadline.load(std::memory_order_relaxed));
+                }
+            }
+        }
+
+        // Same contract as HashSegment::scan(). A cursor step stands for a
+        // home group: the entries whose probe starts there, found along its
+        // probe sequence up to the first group with an empty slot. Keys are
+        // rehashed to tell their home, which keeps the guarantee across a
+        // resize at the price of one hash per entry seen.
+        template <typename Visitor>
+        unsigned long scan(unsigned long cursor, Visitor & visitor, size_t count, const timemilliseconds & now)
+        {
+            size_t mask = capacity / ControlGroup::width - 1;
+            do {
+                visitHome(cursor & mask, visitor, now);
+                cursor = scanNext(cursor, mask);
+            } while (cursor != 0 && --count > 0);
+            return cursor;
+        }
+
+        // Same contract as HashSegment::emplace().
+        template <typename KK, typename... Args>
+        bool emplace(unsigned long hashValue, bool assign, const EntryTime & time, KK && key, Args &&... args)
+        {
+            Writing writing(*this);
+            size_t mixed = mix(hashValue);
+            Slot * slot = findLive(mixed, key, time.now);
+            if (slot == NULL) {
+                insert(mixed, hashValue, time, std::forward<KK>(key), std::forward<Args>(args)...);
+                return true;
+            }
+            if (assign) {
+                size_t before = weigh(*slot);
+                assignValue(slot->value, std::forward<Args>(args)...);
+                slot->setTime(time);
+                reweigh(*slot, before);
+                schedule(*slot, hashValue);
+                if (bounded())
+                    evict();
+            }
+            return false;
+        }
+
+        // Same contract as HashSegment::compute(); fn always works in place.
+        template <typename Init, typename Fn>
+        bool compute(unsigned long hashValue, const K & key, const EntryTime & time, Init & init, Fn & fn)
+        {
+            Writing writing(*this);
+            size_t mixed = mix(hashValue);
+            Slot * slot = findLive(mixed, key, time.now);
+            if (slot == NULL)
+                return computeMissing(mixed, hashValue, key, time, init, fn);
+            size_t before = weigh(*slot);
+            if (!fn(slot->value, true)) {
+                erase(slot, before);
+                shrinkIfSparse();
+                return false;
+            }
+            slot->setTime(time);
+            reweigh(*slot, before);
+            schedule(*slot, hashValue);
+            if (bounded())
+                evict();
+            return true;
+        }
+
+        // Same contract as HashSegment::reserve().
+        void reserve(size_t entries)
+        {
+            if (entries > m_size && growthLeft < entries - m_size) {
+                Writing writing(*this);
+                size_t wanted = capacityFor((size_t)(entries / loadFactor) + 1);
+                resize(wanted > capacity ? wanted : capacity);
+            }
+        }
+
+        // Same contract as HashSegment::shrinkToFit(), but the rebuild is
+        // done at once; it also runs when the capacity is already right but
+        // tombstones have piled up, to drop them.
+        bool shrinkToFit()
+        {
+            size_t fit = ControlGroup::width;
+            while (fit * loadFactor <= m_size)
+                fit <<= 1;
+            bool tombstones = m_size + growthLeft < (size_t)(capacity * loadFactor);
+            if (fit >= capacity && !tombstones)
+                return false;
+            Writing writing(*this);
+            resize(fit < capacity ? fit : capacity);
+            return true;
+        }
+
+        // Same contract as HashSegment::checkShrink(); the shrink is done
+        // by the time it returns.
+        bool checkShrink()
+        {
+            size_t c = sparseCapacity();
+            if (c == 0)
+                return false;
+            Writing writing(*this);
+            resize(c);
+            return true;
+        }
+
+        // Makes room for count inserts up front, so a batch resizes at most
+        // once and never in the middle.
+        void beginBatch(size_t count)
+        {
+            reserve(m_size + count);
+        }
+
+        void endBatch()
+        {
+        }
+
+        // Batch lookups touch the control group, then its slots, a few keys
+        // ahead of the probe.
+        void prefetchBucket(unsigned long hashValue) const
+        {
+            __builtin_prefetch(ctrlBytes + firstGroup(mix(hashValue)) * ControlGroup::width);
+        }
+
+        void prefetchEntry(unsigned long hashValue) const
+        {
+            __builtin_prefetch(slots + firstGroup(mix(hashValue)) * ControlGroup::width);
+        }
+
+        // Same contract as HashSegment::collectExpired().
+        size_t collectExpired(const timemilliseconds & now, size_t limit, std::vector<K> & expired)
+        {
+            auto fire = [&](Slot * slot) {
+                slot->scheduled = 0;
+                expired.push_back(slot->key);
+            };
+            return fireDue(now, limit, fire);
+        }
+
+        // Same contract as HashSegment::removeExpired().
+        size_t removeExpired(const timemilliseconds & now, size_t limit, std::vector<std::pair<K, V> > & expired)
+        {
+            Writing writing(*this);
+            auto fire = [&](Slot * slot) {
+                expired.push_back(std::make_pair(slot->key, std::move(slot->value)));
+                erase(slot);
+            };
+            size_t fired = fireDue(now, limit, fire);
+            shrinkIfSparse();
+            return fired;
+        }
+
+        template <typename Q>
+        bool get(unsigned long hashValue, const Q & key, V & val, const timemilliseconds & now) const
+        {
+            if (optimistic) {
+                auto copy = [&](const V & value) { val = value; };
+                return readOptimistic(hashValue, key, copy, now);
+            }
+            const Slot * slot = findSlot(mix(hashValue), key);
+            if (slot == NULL || !slot->alive(now, sliding))
+                return false;
+            touch(slot);
+            val = slot->value;
+            return true;
+        }
+
+        template <typename Q, typename Fn>
+        bool visit(unsigned long hashValue, const Q & key, Fn & fn, const timemilliseconds & now) const
+        {
+            if (optimistic)
+                return readOptimistic(hashValue, key, fn, now);
+            const Slot * slot = findSlot(mix(hashValue), key);
+            if (slot == NULL || !slot->alive(now, sliding))
+                return false;
+            touch(slot);
+            fn(slot->value);
+            return true;
+        }
+
+        template <typename Q>
+        bool contain(unsigned long hashValue, const Q & key, const timemilliseconds & now) const
+        {
+            if (optimistic) {
+                auto ignore = [](const V &) {};
+                return readOptimistic(hashValue, key, ignore, now);
+            }
+            const Slot * slot = findSlot(mix(hashValue), key);
+            return slot != NULL && slot->alive(now, sliding);
+        }
+
+        template <typename Q>
+        bool remove(unsigned long hashValue, const Q & key, const timemilliseconds & now)
+        {
+            Writing writing(*this);
+            Slot * slot = findLive(mix(hashValue), key, now);
+            if (slot == NULL)
+                return false;
+            erase(slot);
+            shrinkIfSparse();
+            return true;
+        }
+
+        void clear()
+        {
+            Writing writing(*this);
+            destroySlots();
+            memset(ctrlBytes, (unsigned char)ctrl::Empty, capacity);
+            m_size.store(0, std::memory_order_relaxed);
+            bytes = 0;
+            growthLeft = capacity * loadFactor;
+            if (autoShrink && capacity > minCapacity)
+                resize(minCapacity);
+            if (wheel != NULL)
+                wheel->clear();
+            overdue.clear();
+        }
+
+        const ResizeStats & resizeStats() const
+        {
+            return resizes;
+        }
+
+        bool advanceRehash(size_t)
+        {
+            return false;
+        }
+
+        void finishRehash()
+        {
+        }
+
+        ReadWriteMutex * mutex;
+
+    private:
+        struct Slot {
+            K                   key;
+            V                   value;
+            // when the entry expires, 0 for never; atomic for sliding reads
+            mutable std::atomic<timemilliseconds> deadline;
+            // deadline of the pending expiry record, 0 if none
+            timemilliseconds    scheduled;
+            uint32_t            ttl;
+
+            template <typename KK, typename... Args>
+            Slot(const EntryTime & t, KK && k, Args &&... args) : key(std::forward<KK>(k)), value(std::forward<Args>(args)...), deadline(t.deadline), scheduled(0), ttl(t.ttl) {}
+
+            Slot(Slot && other) : key(std::move(other.key)), value(std::move(other.value)), deadline(other.deadline.load(std::memory_order_relaxed)),
+                scheduled(other.scheduled), ttl(other.ttl) {}
+
+            void setTime(const EntryTime & t)
+            {
+                deadline.store(t.deadline, std::memory_order_relaxed);
+                ttl = t.ttl;
+            }
+
+            bool alive(const timemilliseconds & now, bool sliding) const
+            {
+                return aliveAt(deadline.load(std::memory_order_relaxed), deadline, ttl, now, sliding);
+            }
+        };
+
+        // this segment's shard of the table size: only the writer holding
+        // the segment lock updates it, so it adds no shared line to a write
+        std::atomic<size_t> m_size;
+        float   loadFactor;
+        // always a power of two and a multiple of the group width
+        size_t  capacity;
+        // capacity auto-shrink stops at, the initial one
+        size_t  minCapacity;
+        bool    autoShrink;
+        // inserts left before a resize, counting tombstones as used
+        size_t  growthLeft;
+        int8_t * ctrlBytes;
+        Slot *   slots;
+        TimingWheel<ExpiryRecord<K> > * wheel;
+        // the records one fireDue() takes off the wheel, kept for its capacity
+        std::vector<ExpiryRecord<K> > overdue;
+        bool    sliding;
+        ResizeStats resizes;
+        // access bit per slot, set by readers under the read lock; only
+        // allocated for a bounded segment
+        std::atomic<uint8_t> * refBits;
+        size_t  maxEntries;
+        size_t  maxBytes;
+        size_t  bytes;
+        size_t  (* weigher)(const K &, const V &);
+        bool    keepEvicted;
+        // next slot of the CLOCK hand
+        size_t  clockHand;
+        size_t  evictionCount;
+        std::vector<std::pair<K, V> > evicted;
+
+        // The arrays as optimistic readers see them, replaced on resize.
+        struct Arrays {
+            size_t                  capacity;
+            const int8_t *          ctrlBytes;
+            const Slot *            slots;
+            std::atomic<uint8_t> *  refBits;
+        };
+
+        // set in init() for ReadOptimistic mode when the types allow it
+        bool    optimistic;
+        // odd while a writer is changing the segment
+        std::atomic<unsigned long> sequence;
+        std::atomic<Arrays *> published;
+
+        // Brackets a change that optimistic readers may overlap. Changes
+        // do not nest: only the public writers open one.
+        struct Writing {
+            FlatSegment & segment;
+
+            explicit Writing(FlatSegment & s) : segment(s)
+            {
+                if (segment.optimistic) {
+                    segment.sequence.store(segment.sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_release);
+                }
+            }
+
+            ~Writing()
+            {
+                if (segment.optimistic)
+                    segment.sequence.store(segment.sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+            }
+        };
+
+        // Hands the current arrays to optimistic readers. The previous
+        // descriptor is retired, the arrays it points to by resize().
+        void publish()
+        {
+            if (!optimistic)
+                return;
+            Arrays * arrays = new Arrays;
+            arrays->capacity = capacity;
+            arrays->ctrlBytes = ctrlBytes;
+            arrays->slots = slots;
+            arrays->refBits = refBits;
+            Arrays * old = published.exchange(arrays, std::memory_order_release);
+            if (old != NULL)
+                EpochManager::getInstance().retire(old);
+        }
+
+        static void freeSlots(void * p)
+        {
+            ::operator delete(p);
+        }
+
+        // The ReadOptimistic lookup behind get(), visit() and contain(). The
+        // probe runs over the published arrays, copies the key and value of
+        // a candidate out and counts only if the sequence was even before
+        // and unchanged after; fn sees the consistent copy. The caller holds
+        // an EpochGuard, which keeps the arrays of a racing resize alive.
+        template <typename Q, typename Fn>
+        bool readOptimistic(unsigned long hashValue, const Q & key, Fn & fn, const timemilliseconds & now) const
+        {
+            size_t mixed = mix(hashValue);
+            for (int attempt = 1; ; attempt++) {
+                unsigned long before = sequence.load(std::memory_order_acquire);
+                if ((before & 1) == 0) {
+                    const Arrays * arrays = published.load(std::memory_order_acquire);
+                    RacyCopy<V> value;
+                    timemilliseconds deadline = 0;
+                    uint32_t ttl = 0;
+                    size_t index = copyOut(arrays, mixed, key, value, deadline, ttl);
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    // past capacity: the probe ran through a torn table
+                    if (sequence.load(std::memory_order_relaxed) == before && index <= arrays->capacity) {
+                        if (index == arrays->capacity || !aliveAt(deadline, arrays->slots[index].deadline, ttl, now, sliding))
+                            return false;
+                        if (arrays->refBits != NULL && arrays->refBits[index].load(std::memory_order_relaxed) == 0)
+                            arrays->refBits[index].store(1, std::memory_order_relaxed);
+                        fn(value.get());
+                        return true;
+                    }
+                }
+                if (attempt % 64 == 0)
+                    sched_yield();
+            }
+        }
+
+        // Probes the arrays for key without trusting them: returns the slot
+        // found, with its value, deadline and TTL copied out, capacity when
+        // the key is missing and capacity + 1 when no empty slot turned up
+        // in a full round of groups.
+        template <typename Q>
+        static size_t copyOut(const Arrays * arrays, size_t mixed, const Q & key, RacyCopy<V> & value, timemilliseconds & deadline, uint32_t & ttl)
+        {
+            const int8_t tag = h2(mixed);
+            size_t groups = arrays->capacity / ControlGroup::width;
+            size_t group = (mixed >> 7) & (groups - 1);
+            for (size_t step = 1; step <= groups; step++) {
+                size_t offset = group * ControlGroup::width;
+                ControlGroup g(arrays->ctrlBytes + offset);
+                for (unsigned m = g.match(tag); m != 0; m &= m - 1) {
+                    size_t index = offset + __builtin_ctz(m);
+                    RacyCopy<K> candidate;
+                    candidate.load(arrays->slots[index].key);
+                    if (candidate.get() == key) {
+                        const Slot & slot = arrays->slots[index];
+                        value.load(slot.value);
+                        deadline = slot.deadline.load(std::memory_order_relaxed);
+                        RacyCopy<uint32_t> copy;
+                        copy.load(slot.ttl);
+                        ttl = copy.get();
+                        return index;
+                    }
+                }
+                if (g.matchEmpty() != 0)
+                    return arrays->capacity;
+                group = (group + step) & (groups - 1);
+            }
+            return arrays->capacity + 1;
+        }
+
+        // Same as HashSegment::fireDue(), calling fire(slot).
+        template <typename Fire>
+        size_t fireDue(const timemilliseconds & now, size_t limit, Fire & fire)
+        {
+            if (wheel == NULL)
+                return 0;
+
+            wheel->advance(now, overdue, limit);
+            size_t fired = 0;
+            while (fired < limit && !overdue.empty()) {
+                ExpiryRecord<K> r(std::move(overdue.back()));
+                overdue.pop_back();
+                fired += 1;
+                Slot * slot = findSlot(mix(r.hash), r.key);
+                if (slot == NULL || slot->scheduled != r.deadline)
+                    continue;
+                timemilliseconds deadline = slot->deadline.load(std::memory_order_relaxed);
+                if (deadline == 0) {
+                    slot->scheduled = 0;
+                } else if (deadline <= now) {
+                    fire(slot);
+                } else {
+                    slot->scheduled = deadline;
+                    r.deadline = deadline;
+                    wheel->add(r);
+                }
+            }
+            return fired;
+        }
+
+        // Same as HashSegment::schedule().
+        void schedule(Slot & slot, unsigned long hashValue)
+        {
+            timemilliseconds deadline = slot.deadline.load(std::memory_order_relaxed);
+            if (wheel != NULL && deadline != 0 && (slot.scheduled == 0 || deadline < slot.scheduled)) {
+                slot.scheduled = deadline;
+                wheel->add(ExpiryRecord<K>(slot.key, hashValue, deadline));
+            }
+        }
+
+        // findSlot() for writers: an entry past its deadline at now is erased
+        // on the way and reported missing.
+        template <typename Q>
+        Slot * findLive(size_t mixed, const Q & key, const timemilliseconds & now)
+        {
+            Slot * slot = findSlot(mixed, key);
+            if (slot != NULL && !slot->alive(now, false)) {
+                erase(slot);
+                slot = NULL;
+            }
+            return slot;
+        }
+
+        template <typename KK, typename... Args>
+        void insert(size_t mixed, unsigned long hashValue, const EntryTime & time, KK && key, Args &&... args)
+        {
+            size_t index = findInsertSlot(mixed);
+            if (growthLeft == 0 && ctrlBytes[index] == ctrl::Empty) {
+                // grows, or just drops tombstones when they are what fills it
+                resize(m_size + 1 > capacity * loadFactor / 2 ? capacity << 1 : capacity);
+                index = findInsertSlot(mixed);
+            }
+            if (ctrlBytes[index] == ctrl::Empty)
+                growthLeft -= 1;
+            ctrlBytes[index] = h2(mixed);
+            new (&slots[index]) Slot(time, std::forward<KK>(key), std::forward<Args>(args)...);
+            schedule(slots[index], hashValue);
+            m_size.store(m_size.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            if (bounded()) {
+                bytes += weigh(slots[index]);
+                // a new entry gets one turn of the hand before it can go
+                touch(&slots[index]);
+                evict();
+            }
+        }
+
+        void erase(Slot * slot)
+        {
+            erase(slot, weigh(*slot));
+        }
+
+        // weight is what slot weighed when it was last accounted
+        void erase(Slot * slot, size_t weight)
+        {
+            size_t index = slot - slots;
+            bytes -= weight;
+            size_t group = index & ~(ControlGroup::width - 1);
+            slot->~Slot();
+            // a probe only stops at an empty byte, so the slot can only become
+            // empty again if its group already had one
+            if (ControlGroup(ctrlBytes + group).matchEmpty() != 0) {
+                ctrlBytes[index] = ctrl::Empty;
+                growthLeft += 1;
+            } else {
+                ctrlBytes[index] = ctrl::Deleted;
+            }
+            m_size.store(m_size.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+        }
+
+        bool bounded() const
+        {
+            return maxEntries != 0 || maxBytes != 0;
+        }
+
+        // The capacity to shrink to once the segment has emptied below the
+        // low-water mark, 0 otherwise.
+        size_t sparseCapacity() const
+        {
+            if (!autoShrink || capacity <= minCapacity || m_size >= (size_t)(capacity * loadFactor) / shrinkDivisor)
+                return 0;
+            size_t c = minCapacity;
+            while (c * loadFactor <= 4 * m_size)
+                c <<= 1;
+            return c < capacity ? c : 0;
+        }
+
+        // checkShrink() for the writes, which have writing open already
+        void shrinkIfSparse()
+        {
+            size_t c = sparseCapacity();
+            if (c != 0)
+                resize(c);
+        }
+
+        bool overLimit() const
+        {
+            return (maxEntries != 0 && m_size > maxEntries) || (maxBytes != 0 && bytes > maxBytes);
+        }
+
+        size_t weigh(const Slot & slot) const
+        {
+            if (maxBytes == 0)
+                return 0;
+            return weigher != NULL ? weigher(slot.key, slot.value) : sizeof(Slot);
+        }
+
+        void reweigh(const Slot & slot, size_t before)
+        {
+            if (maxBytes != 0)
+                bytes = bytes - before + weigh(slot);
+        }
+
+        void touch(const Slot * slot) const
+        {
+            if (refBits != NULL) {
+                std::atomic<uint8_t> & bit = refBits[slot - slots];
+                if (bit.load(std::memory_order_relaxed) == 0)
+                    bit.store(1, std::memory_order_relaxed);
+            }
+        }
+
+        static std::atomic<uint8_t> * newRefBits(size_t count)
+        {
+            std::atomic<uint8_t> * bits = new std::atomic<uint8_t>[count];
+            for (size_t i = 0; i < count; i++)
+                bits[i].store(0, std::memory_order_relaxed);
+            return bits;
+        }
+
+        // CLOCK over the slots: an entry with its access bit set loses the
+        // bit and is passed over, the first one without is evicted. Two
+        // turns without enough victims give up until the next write.
+        void evict()
+        {
+            for (size_t budget = 2 * capacity; overLimit() && budget > 0; budget--) {
+                size_t index = clockHand++ & (capacity - 1);
+                if (ctrlBytes[index] < 0)
+                    continue;
+                if (refBits[index].exchange(0, std::memory_order_relaxed) != 0)
+                    continue;
+                Slot & slot = slots[index];
+                if (keepEvicted)
+                    evicted.push_back(std::make_pair(slot.key, slot.value));
+                evictionCount += 1;
+                erase(&slot);
+            }
+        }
+
+        template <typename Init, typename Fn>
+        bool computeMissing(size_t mixed, unsigned long hashValue, const K & key, const EntryTime & time, Init & init, Fn & fn)
+        {
+            V value(init());
+            if (!fn(value, false))
+                return false;
+            insert(mixed, hashValue, time, key, std::move(value));
+            return true;
+        }
+
+        template <typename Fn>
+        bool computeMissing(size_t, unsigned long, const K &, const EntryTime &, NoInsert &, Fn &)
+        {
+            return false;
+        }
+
+        static size_t capacityFor(size_t wanted)
+        {
+            size_t c = ControlGroup::width;
+            while (c < wanted)
+                c <<= 1;
+            return c;
+        }
+
+        // Spreads weak hashes such as the identity over all bits before the
+        // split into group index (high bits) and control byte (low 7 bits).
+        static size_t mix(unsigned long hashValue)
+        {
+            unsigned long h = hashValue * 0x9E3779B97F4A7C15UL;
+            return h ^ (h >> 29);
+        }
+
+        static int8_t h2(size_t mixed)
+        {
+            return (int8_t)(mixed & 0x7F);
+        }
+
+        void allocate(size_t newCapacity)
+        {
+            capacity = newCapacity;
+            ctrlBytes = new int8_t[capacity];
+            memset(ctrlBytes, (unsigned char)ctrl::Empty, capacity);
+            slots = static_cast<Slot *>(::operator new(capacity * sizeof(Slot)));
+            m_size.store(0, std::memory_order_relaxed);
+            growthLeft = capacity * loadFactor;
+        }
+
+        void destroySlots()
+        {
+            for (size_t i = 0; i < capacity; i++) {
+                if (ctrlBytes[i] >= 0) {
+                    slots[i].~Slot();
+                    ctrlBytes[i] = ctrl::Empty;
+                }
+            }
+        }
+
+        size_t firstGroup(size_t mixed) const
+        {
+            return (mixed >> 7) & (capacity / ControlGroup::width - 1);
+        }
+
+        // Triangular probing over whole groups visits every group once when
+        // the group count is a power of two.
+        template <typename Probe>
+        size_t probe(size_t mixed, Probe & visit) const
+        {
+            size_t groups = capacity / ControlGroup::width;
+            size_t group = firstGroup(mixed);
+            for (size_t step = 1; ; step++) {
+                size_t result;
+                if (visit(group * ControlGroup::width, result))
+                    return result;
+                group = (group + step) & (groups - 1);
+            }
+        }
+
+        template <typename Visitor>
+        void visitHome(size_t home, Visitor & visitor, const timemilliseconds & now)
+        {
+            size_t groups = capacity / ControlGroup::width;
+            size_t group = home;
+            for (size_t step = 1; step <= groups; step++) {
+                size_t base = group * ControlGroup::width;
+                for (size_t i = 0; i < ControlGroup::width; i++) {
+                    const Slot & slot = slots[base + i];
+                    if (ctrlBytes[base + i] >= 0 && firstGroup(mix(hashFormula(slot.key))) == home && slot.alive(now, false))
+                        visitor(slot.key, slot.value, slot.deadline.load(std::memory_order_relaxed));
+                }
+                if (ControlGroup(ctrlBytes + base).matchEmpty() != 0)
+                    break;
+                group = (group + step) & (groups - 1);
+            }
+        }
+
+        template <typename Q>
+        Slot * findSlot(size_t mixed, const Q & key) const
+        {
+            const int8_t tag = h2(mixed);
+            Slot * const base = slots;
+            const int8_t * const c = ctrlBytes;
+            size_t notFound = capacity;
+            auto visit = [&](size_t offset, size_t & result) -> bool {
+                ControlGroup group(c + offset);
+                for (unsigned m = group.match(tag); m != 0; m &= m - 1) {
+                    size_t index = offset + __builtin_ctz(m);
+                    if (base[index].key == key) {
+                        result = index;
+                        return true;
+                    }
+                }
+                if (group.matchEmpty() != 0) {
+                    result = notFound;
+                    return true;
+                }
+                return false;
+            };
+            size_t index = probe(mixed, visit);
+            return index == notFound ? NULL : base + index;
+        }
+
+        size_t findInsertSlot(size_t mixed) const
+        {
+            const int8_t * const c = ctrlBytes;
+            auto visit = [&](size_t offset, size_t & result) -> bool {
+                unsigned m = ControlGroup(c + offset).matchEmptyOrDeleted();
+                if (m == 0)
+                    return false;
+                result = offset + __builtin_ctz(m);
+                return true;
+            };
+            return probe(mixed, visit);
+        }
+
+        // Moves every entry into freshly allocated arrays; entries are moved,
+        // not copied, and tombstones are dropped on the way.
+        void resize(size_t newCapacity)
+        {
+            long long begin = monotonicNanoseconds();
+            int8_t * oldCtrl = ctrlBytes;
+            Slot *   oldSlots = slots;
+            std::atomic<uint8_t> * oldRefBits = refBits;
+            size_t   oldCapacity = capacity;
+            size_t   count = m_size;
+
+            allocate(newCapacity);
+            if (oldRefBits != NULL)
+                refBits = newRefBits(newCapacity);
+            for (size_t i = 0; i < oldCapacity; i++) {
+                if (oldCtrl[i] < 0)
+                    continue;
+                Slot & from = oldSlots[i];
+                // slots keep no hash, unlike chained nodes: rehash the key
+                size_t mixed = mix(hashFormula(from.key));
+                size_t index = findInsertSlot(mixed);
+                ctrlBytes[index] = h2(mixed);
+                new (&slots[index]) Slot(std::move(from));
+                from.~Slot();
+                if (oldRefBits != NULL)
+                    refBits[index].store(oldRefBits[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            }
+            m_size.store(count, std::memory_order_relaxed);
+            growthLeft -= count;
+
+            if (optimistic) {
+                // readers may still be probing the old arrays
+                EpochManager & epoch = EpochManager::getInstance();
+                publish();
+                epoch.retire(oldSlots, freeSlots);
+                epoch.retireArray(oldCtrl);
+                if (oldRefBits != NULL)
+                    epoch.retireArray(oldRefBits);
+            } else {
+                ::operator delete(oldSlots);
+                delete [] oldCtrl;
+                delete [] oldRefBits;
+            }
+            resizes.moved += count;
+            resizes.finished(monotonicNanoseconds() - begin);
+        }
+
+        F       hashFormula;
+        // same as in HashSegment
+        char    padding[counterPadding];
+    };
+}
+#endif // FLATSEGMENT_H
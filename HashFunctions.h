@@ -0,0 +1,186 @@
+#ifndef HASHFUNCTIONS_H
+#define HASHFUNCTIONS_H
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <stdint.h>
+#include <string.h>
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+
+namespace dt {
+
+    // Finalizer of a strong 64-bit integer hash: every input bit affects
+    // every output bit, so sequential ids spread over all buckets and all
+    // segments.
+    inline unsigned long mixInteger(unsigned long x)
+    {
+        x ^= x >> 32;
+        x *= 0xd6e8feb86659fd93UL;
+        x ^= x >> 32;
+        x *= 0xd6e8feb86659fd93UL;
+        x ^= x >> 32;
+        return x;
+    }
+
+    namespace detail {
+        const uint64_t wySecret0 = 0xa0761d6478bd642fULL;
+        const uint64_t wySecret1 = 0xe7037ed1a0b428dbULL;
+        const uint64_t wySecret2 = 0x8ebc6af09c88c6e3ULL;
+        const uint64_t wySecret3 = 0x589965cc75374cc3ULL;
+
+        // 64x64 -> 128 bit multiply folded back to 64 bits
+        inline uint64_t wyMix(uint64_t a, uint64_t b)
+        {
+            __uint128_t r = (__uint128_t) a * b;
+            return (uint64_t) r ^ (uint64_t)(r >> 64);
+        }
+
+        inline uint64_t read8(const uint8_t * p)
+        {
+            uint64_t v;
+            memcpy(&v, p, 8);
+            return v;
+        }
+
+        inline uint64_t read4(const uint8_t * p)
+        {
+            uint32_t v;
+            memcpy(&v, p, 4);
+            return v;
+        }
+
+        // 1 to 3 bytes, each of them read once
+        inline uint64_t read3(const uint8_t * p, size_t len)
+        {
+            return ((uint64_t) p[0] << 16) | ((uint64_t) p[len >> 1] << 8) | p[len - 1];
+        }
+
+        // Byte hash in the style of wyhash: 16 bytes per multiply, three
+        // independent lanes for long inputs.
+        inline uint64_t wyHash(const void * key, size_t len, uint64_t seed)
+        {
+            const uint8_t * p = static_cast<const uint8_t *>(key);
+            seed ^= wyMix(seed ^ wySecret0, wySecret1);
+            uint64_t a, b;
+            if (len <= 16) {
+                if (len >= 4) {
+                    a = (read4(p) << 32) | read4(p + ((len >> 3) << 2));
+                    b = (read4(p + len - 4) << 32) | read4(p + len - 4 - ((len >> 3) << 2));
+                } else if (len > 0) {
+                    a = read3(p, len);
+                    b = 0;
+                } else {
+                    a = b = 0;
+                }
+            } else {
+                size_t i = len;
+                if (i > 48) {
+                    uint64_t seed1 = seed, seed2 = seed;
+                    do {
+                        seed = wyMix(read8(p) ^ wySecret1, read8(p + 8) ^ seed);
+                        seed1 = wyMix(read8(p + 16) ^ wySecret2, read8(p + 24) ^ seed1);
+                        seed2 = wyMix(read8(p + 32) ^ wySecret3, read8(p + 40) ^ seed2);
+                        p += 48;
+                        i -= 48;
+                    } while (i > 48);
+                    seed ^= seed1 ^ seed2;
+                }
+                while (i > 16) {
+                    seed = wyMix(read8(p) ^ wySecret1, read8(p + 8) ^ seed);
+                    p += 16;
+                    i -= 16;
+                }
+                a = read8(p + i - 16);
+                b = read8(p + i - 8);
+            }
+            __uint128_t r = (__uint128_t)(a ^ wySecret1) * (b ^ seed);
+            return wyMix((uint64_t) r ^ wySecret0 ^ len, (uint64_t)(r >> 64) ^ wySecret1);
+        }
+
+#if defined(__SSE4_2__)
+        // Two CRC32C lanes over alternate words, one crc32 instruction per
+        // 8 bytes, finished by the integer mixer since CRC alone leaves
+        // the high bits weak.
+        inline uint64_t crcHash(const void * key, size_t len, uint64_t seed)
+        {
+            const uint8_t * p = static_cast<const uint8_t *>(key);
+            uint64_t lo = seed, hi = ~seed;
+            size_t i = len;
+            for (; i >= 16; i -= 16, p += 16) {
+                lo = _mm_crc32_u64(lo, read8(p));
+                hi = _mm_crc32_u64(hi, read8(p + 8));
+            }
+            if (i >= 8) {
+                lo = _mm_crc32_u64(lo, read8(p));
+                p += 8;
+                i -= 8;
+            }
+            if (i > 0) {
+                uint64_t tail = 0;
+                memcpy(&tail, p, i);
+                hi = _mm_crc32_u64(hi, tail);
+            }
+            return mixInteger((hi << 32 | lo) ^ len);
+        }
+#endif
+    }
+
+    // Hash of len bytes: CRC32C based when the target has SSE4.2, the
+    // wyhash-style multiply hash otherwise.
+    inline unsigned long hashBytes(const void * key, size_t len, unsigned long seed = 0)
+    {
+#if defined(__SSE4_2__)
+        return detail::crcHash(key, len, seed);
+#else
+        return detail::wyHash(key, len, seed);
+#endif
+    }
+
+    // Default hash function class: integers, enums and pointers go through
+    // mixInteger(); other key types need their own specialization.
+    template <typename K>
+    struct KeyHash {
+        static_assert(std::is_integral<K>::value || std::is_enum<K>::value || std::is_pointer<K>::value,
+                      "KeyHash has no default for this key type: pass a hash function class");
+
+        unsigned long operator()(const K & key) const
+        {
+            if constexpr (std::is_pointer<K>::value)
+                return mixInteger(reinterpret_cast<uintptr_t>(key));
+            else
+                return mixInteger((unsigned long) key);
+        }
+    };
+
+    // Strings hash their bytes. The hasher is transparent: a table with
+    // std::string keys can be probed with a string_view or a C string
+    // without building a temporary std::string.
+    template <>
+    struct KeyHash<std::string> {
+        typedef void is_transparent;
+
+        unsigned long operator()(std::string_view key) const
+        {
+            return hashBytes(key.data(), key.size());
+        }
+    };
+
+    template <>
+    struct KeyHash<std::string_view> : KeyHash<std::string> {
+    };
+
+    // Tells whether the hash function class F accepts other types than the
+    // key type, which enables the heterogeneous lookups of Hashtable.
+    template <typename F, typename = void>
+    struct IsTransparent : std::false_type {
+    };
+
+    template <typename F>
+    struct IsTransparent<F, std::void_t<typename F::is_transparent> > : std::true_type {
+    };
+}
+#endif // HASHFUNCTIONS_H
@@ -2,72 +2,240 @@
 #define HASHNODE_H
 
 #include <cstddef>
+#include <atomic>
+#include <utility>
+#include <stdint.h>
 #include "Common.h"
+#include "HashFunctions.h"
 
 namespace dt { 
+
+    // Assigns a value built from args to target: a single argument is
+    // assigned straight away (copy or move), several construct a temporary.
+    template <typename T, typename A>
+    void assignValue(T & target, A && arg)
+    {
+        target = std::forward<A>(arg);
+    }
+
+    template <typename T, typename... Args>
+    void assignValue(T & target, Args &&... args)
+    {
+        target = T(std::forward<Args>(args)...);
+    }
     
-    // Hash node class template
-    template <typename K, typename V>
-    class HashNode : noncopyable
+    // Timing of a write, on the table clock: when it happens (0 when the
+    // table keeps no deadlines), when the entry expires (0: never) and the
+    // TTL a sliding read pushes the deadline out by.
+    struct EntryTime {
+        timemilliseconds    now;
+        timemilliseconds    deadline;
+        uint32_t            ttl;
+
+        EntryTime() : now(0), deadline(0), ttl(0) {}
+    };
+
+    // A deadline pushes further only by this much at least, so that a hot
+    // entry read under a sliding TTL does not dirty its cache line on every
+    // read; it matches the timing wheel resolution.
+    const timemilliseconds slideStepMs = 10;
+
+    // Expiry check of readers, shared by the storage backends: whether an
+    // entry whose deadline was seen as seen, and which has the given TTL,
+    // is still there at now (0 when deadlines are not checked). With
+    // sliding, a live entry has its deadline pushed to now plus the TTL.
+    inline bool aliveAt(const timemilliseconds & seen, std::atomic<timemilliseconds> & deadline, uint32_t ttl, const timemilliseconds & now, bool sliding)
+    {
+        if (now == 0 || seen == 0)
+            return true;
+        if (seen <= now)
+            return false;
+        if (sliding && ttl != 0 && now + ttl >= seen + slideStepMs)
+            deadline.store(now + ttl, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Expiry fields of a node, selected by its Timed parameter: the
+    // deadline, the deadline of the pending expiry record and the TTL of
+    // the last write. The untimed layout is empty, so a node built without
+    // them loses the 24 bytes, and its entries never expire.
+    template <bool Timed>
+    class NodeTiming
+    {
+    public:
+        explicit NodeTiming(const EntryTime & t) : deadline(t.deadline), scheduled(0), ttl(t.ttl)
+        {
+        }
+
+        // When the entry expires, 0 for never. Sliding reads move it out
+        // without any lock, hence the atomic.
+        timemilliseconds getDeadline() const {
+            return deadline.load(std::memory_order_relaxed);
+        }
+
+        void setTime(const EntryTime & t) {
+            deadline.store(t.deadline, std::memory_order_relaxed);
+            ttl = t.ttl;
+        }
+
+        uint32_t getTtl() const {
+            return ttl;
+        }
+
+        // Whether the entry is still there for a reader at now, 0 meaning
+        // that deadlines are not checked. With sliding, a live entry has its
+        // deadline pushed to now plus its TTL.
+        bool alive(const timemilliseconds & now, bool sliding) const {
+            return aliveAt(deadline.load(std::memory_order_relaxed), deadline, ttl, now, sliding);
+        }
+
+        // deadline of the expiry record this node has pending, 0 if none
+        timemilliseconds getScheduled() const {
+            return scheduled;
+        }
+
+        void setScheduled(const timemilliseconds & deadline) {
+            scheduled = deadline;
+        }
+
+    private:
+        mutable std::atomic<timemilliseconds> deadline;
+        timemilliseconds scheduled;
+        // TTL of the last write in milliseconds, for sliding reads
+        uint32_t ttl;
+    };
+
+    template <>
+    class NodeTiming<false>
+    {
+    public:
+        explicit NodeTiming(const EntryTime &)
+        {
+        }
+
+        timemilliseconds getDeadline() const {
+            return 0;
+        }
+
+        void setTime(const EntryTime &) {
+        }
+
+        uint32_t getTtl() const {
+            return 0;
+        }
+
+        bool alive(const timemilliseconds &, bool) const {
+            return true;
+        }
+
+        timemilliseconds getScheduled() const {
+            return 0;
+        }
+
+        void setScheduled(const timemilliseconds &) {
+        }
+    };
+
+    // Hash node class template. The node keeps the low 32 bits of its key
+    // hash: chain walks compare them before the keys, and a resize picks
+    // the new bucket from them without hashing the key again, which holds
+    // for segments of up to 2^32 buckets. The small fields come last, so
+    // that they share a word with small keys and values.
+    template <typename K, typename V, bool Timed = true>
+    class HashNode : public NodeTiming<Timed>, noncopyable
     {
     public:
     
-        HashNode(const K &key, const V &value, const timemilliseconds & t) :
-            _key(key), _value(value),time(t),  _next(NULL)
+        // the value is constructed in place from args
+        template <typename KK, typename... Args>
+        HashNode(unsigned long hashValue, const EntryTime & t, KK && key, Args &&... args) : NodeTiming<Timed>(t),
+            _next(NULL), _key(std::forward<KK>(key)), _value(std::forward<Args>(args)...), hash((uint32_t)hashValue), referenced(0)
         {
         }
 
-        K getKey() const
+        const K & getKey() const
         {
             return _key;
         }
 
-        V getValue() const
+        const V & getValue() const
+        {
+            return _value;
+        }
+
+        // for updates in place, which only a segment without lock-free readers may do
+        V & getValue()
         {
             return _value;
         }
 
-        void setValue(V value)
+        template <typename VV>
+        void setValue(VV && value)
         {
-            _value = value;
+            _value = std::forward<VV>(value);
         }
 
+        unsigned long getHash() const
+        {
+            return hash;
+        }
+
+        // Whether the node holds key, whose hash is hashValue; the cached
+        // hash turns most mismatches away without comparing keys.
+        template <typename Q>
+        bool matches(unsigned long hashValue, const Q & key) const
+        {
+            return hash == (uint32_t)hashValue && _key == key;
+        }
+
+        // acquire/release so that lock-free readers see a fully built node
         HashNode *getNext() const
         {
-            return _next;
+            return _next.load(std::memory_order_acquire);
         }
 
         void setNext(HashNode *next)
         {
-            _next = next;
+            _next.store(next, std::memory_order_release);
+        }
+
+        // CLOCK access bit of bounded tables. Readers set it without any lock,
+        // and only when it is clear, so hot entries do not keep dirtying the
+        // cache line.
+        void touch() const
+        {
+            if (referenced.load(std::memory_order_relaxed) == 0)
+                referenced.store(1, std::memory_order_relaxed);
         }
-        
-        void setTime(long newTime) {
-            time = newTime;
+
+        // clears the access bit and tells whether it was set
+        bool clearReferenced()
+        {
+            if (referenced.load(std::memory_order_relaxed) == 0)
+                return false;
+            referenced.store(0, std::memory_order_relaxed);
+            return true;
+        }
+
+        bool isReferenced() const
+        {
+            return referenced.load(std::memory_order_relaxed) != 0;
         }
-        
-        timemilliseconds getTime() {
-            return time;
+
+        void setReferenced(bool value)
+        {
+            referenced.store(value ? 1 : 0, std::memory_order_relaxed);
         }
 
     private:
+        // next bucket with the same key
+        std::atomic<HashNode *> _next;
     // key-value pair
         K _key;
         V _value;
-        timemilliseconds time;
-        // next bucket with the same key
-        HashNode *_next;
+        uint32_t hash;
+        mutable std::atomic<unsigned char> referenced;
         bool operator==(const HashNode& other) const;
     };
-
-    // Default hash function class
-    template <typename K>
-    struct KeyHash {
-        unsigned long operator()(const K &key) const
-        {
-            unsigned long val =  reinterpret_cast<unsigned long  >(key) ;
-            return val;
-        }
-    };
 }
 #endif // HASHNODE_H
@@ -0,0 +1,957 @@
+#ifndef HASHSEGMENT_H
+#define HASHSEGMENT_H
+
+#include <cstddef>
+#include <atomic>
+#include <vector>
+#include <iterator>
+#include <utility>
+
+#include "Common.h"
+#include "Threads.h"
+#include "Epoch.h"
+#include "HashNode.h"
+#include "NodeAllocator.h"
+#include "TimingWheel.h"
+#include "HashtableStats.h"
+
+namespace dt {
+
+    const float defaultLoadFactor = 0.75f;
+    // old buckets moved to the new array by every write during a resize
+    const size_t defaultRehashStep = 16;
+    // A segment with auto-shrink on shrinks once its entries fall under
+    // 1/shrinkDivisor of its threshold, to a capacity where they fill a
+    // quarter of it, the load right after a growth by four. Between the two
+    // marks neither removes nor inserts resize.
+    const size_t shrinkDivisor = 16;
+
+    // How get() and contain() synchronize with writers.
+    enum ReadMode {
+        // readers take the segment read lock
+        ReadLocked,
+        // readers walk the chains without any lock; writers never modify a
+        // published node and retire unlinked nodes through the EpochManager
+        ReadLockFree,
+        // readers copy the entry out without any lock or shared write and
+        // retry when the segment sequence moved meanwhile; only FlatStorage
+        // tables with trivially copyable keys and values, which read locked
+        // otherwise
+        ReadOptimistic
+    };
+
+    // Init argument of compute() for updates that never insert a missing key.
+    struct NoInsert {
+    };
+
+    inline unsigned long reverseBits(unsigned long v)
+    {
+        v = ((v >> 1) & 0x5555555555555555UL) | ((v & 0x5555555555555555UL) << 1);
+        v = ((v >> 2) & 0x3333333333333333UL) | ((v & 0x3333333333333333UL) << 2);
+        v = ((v >> 4) & 0x0F0F0F0F0F0F0F0FUL) | ((v & 0x0F0F0F0F0F0F0F0FUL) << 4);
+        return __builtin_bswap64(v);
+    }
+
+    // Next bucket of a scan over a power-of-two table with the given mask.
+    // The cursor counts with its bits reversed, so the buckets already
+    // visited are the same set of hash suffixes whatever the table size:
+    // a table that grows or shrinks by powers of two between two steps
+    // neither skips nor repeats a whole bucket's worth of keys. 0 once the
+    // table is covered.
+    inline unsigned long scanNext(unsigned long cursor, size_t mask)
+    {
+        cursor |= ~(unsigned long) mask;
+        cursor = reverseBits(cursor);
+        cursor += 1;
+        return reverseBits(cursor);
+    }
+
+    // A bucket array together with its capacity, always a power of two so
+    // that the bucket is picked with a mask, so that a lock-free reader
+    // always sees a matching pair. While the segment is resizing, forward
+    // points to the array that buckets are being moved into, and every moved
+    // bucket holds the moved() marker instead of a chain.
+    template <typename N>
+    struct BucketArray : noncopyable {
+        size_t                          capacity;
+        std::atomic<N *> * slots;
+        std::atomic<BucketArray *>      forward;
+
+        BucketArray(size_t size) : capacity(size), slots(new std::atomic<N *>[size]), forward(NULL)
+        {
+            for (size_t i = 0; i < size; i++) {
+                slots[i].store(NULL, std::memory_order_relaxed);
+            }
+        }
+
+        ~BucketArray()
+        {
+            delete [] slots;
+        }
+
+        size_t index(unsigned long hashValue) const
+        {
+            return hashValue & (capacity - 1);
+        }
+
+        std::atomic<N *> & slot(unsigned long hashValue)
+        {
+            return slots[index(hashValue)];
+        }
+
+        // Address stored in a bucket whose chain now lives in forward. It is
+        // only ever compared, never dereferenced.
+        static N * moved()
+        {
+            static char marker;
+            return reinterpret_cast<N *>(&marker);
+        }
+    };
+
+    // One independently locked slice of a Hashtable. Every segment owns its
+    // bucket array, its size, its threshold and its rehash; the owning table
+    // picks the segment from the key hash and holds the segment mutex around
+    // each call below, except find() in ReadLockFree mode, which only needs an
+    // EpochGuard.
+    //
+    // Growth is incremental: crossing the threshold only allocates the new
+    // array. Each later write moves a few old buckets across, plus the bucket
+    // it is about to modify, so writes always land in the newest array while
+    // lookups follow moved buckets to it. Shrinking goes the same way, with
+    // several old buckets folding into each new one. In ReadLocked mode the nodes
+    // themselves are relinked; in ReadLockFree mode a reader may be walking
+    // the old chain, so the nodes are copied and the originals retired.
+    //
+    // Nodes come from the node allocator A (NewAllocator or SlabAllocator).
+    // Without Timed they leave out the expiry fields: such a segment keeps
+    // no deadlines, and trackDeadlines() does nothing.
+    template <typename K, typename V, typename F, typename A = NewAllocator, bool Timed = true>
+    class HashSegment : noncopyable
+    {
+        typedef HashNode<K, V, Timed> Node;
+        typedef BucketArray<Node> Buckets;
+
+    public:
+        static const bool lockFreeReads = true;
+        static const bool optimisticReads = false;
+        static const bool timed = Timed;
+
+        static SlabStats allocatorStats()
+        {
+            return A::template stats<Node>();
+        }
+
+        HashSegment() : mutex(NULL), m_size(0), loadFactor(defaultLoadFactor), threshold(0), minCapacity(1), autoShrink(false), readMode(ReadLocked), batching(false), migrateIndex(0), rehashStart(0), table(NULL), wheel(NULL), sliding(false),
+            maxEntries(0), maxBytes(0), bytes(0), weigher(NULL), keepEvicted(false), clockHand(0), evictionCount(0)
+        {
+        }
+
+        ~HashSegment()
+        {
+            Buckets * t = table.load(std::memory_order_relaxed);
+            if (t != NULL) {
+                clear();
+                delete table.load(std::memory_order_relaxed);
+            }
+            delete wheel;
+            delete mutex;
+        }
+
+        // With shrink, the segment shrinks back towards initCapacity as it
+        // empties, and clear() returns it to that size. With slide, reads
+        // push deadlines out by the TTL of the entry; it is set here, before
+        // any reader, as lock-free reads look at it without a lock.
+        void init(size_t initCapacity, float factor, ReadMode mode, bool shrink, bool slide)
+        {
+            mutex = new ReadWriteMutex();
+            sliding = slide;
+            size_t capacity = 1;
+            while (capacity < initCapacity)
+                capacity <<= 1;
+            loadFactor = factor;
+            readMode = mode;
+            minCapacity = capacity;
+            autoShrink = shrink;
+            threshold = capacity * loadFactor;
+            table.store(new Buckets(capacity), std::memory_order_release);
+        }
+
+        // Starts the expiry index, which entries with a deadline are filed
+        // in from then on.
+        void trackDeadlines(const timemilliseconds & now)
+        {
+            if (!Timed)
+                return;
+            if (wheel == NULL)
+                wheel = new TimingWheel<ExpiryRecord<K> >(now);
+        }
+
+        // Makes the segment a bounded cache of at most entries entries and
+        // bytes bytes, as measured by weigher (the node size when NULL); 0
+        // leaves that limit off. With keep, evicted pairs are kept for
+        // takeEvicted(). Must be called before the first insert.
+        void bound(size_t entries, size_t byteLimit, size_t (* w)(const K &, const V &), bool keep)
+        {
+            maxEntries = entries;
+            maxBytes = byteLimit;
+            weigher = w;
+            keepEvicted = keep;
+        }
+
+        // Moves out the pairs evicted since the last call.
+        void takeEvicted(std::vector<std::pair<K, V> > & out)
+        {
+            if (!evicted.empty()) {
+                out.insert(out.end(), std::make_move_iterator(evicted.begin()), std::make_move_iterator(evicted.end()));
+                evicted.clear();
+            }
+        }
+
+        size_t evictions() const
+        {
+            return evictionCount;
+        }
+
+        // Written under the write lock only, but readable without any lock,
+        // as Hashtable::size() adds the segments up without locking.
+        size_t size() const
+        {
+            return m_size.load(std::memory_order_relaxed);
+        }
+
+        // Buckets seen by iteration: during a resize the old array followed
+        // by the new one, where every entry sits in exactly one of them.
+        size_t bucketCount() const
+        {
+            Buckets * t = table.load(std::memory_order_acquire);
+            Buckets * next = t->forward.load(std::memory_order_acquire);
+            return t->capacity + (next != NULL ? next->capacity : 0);
+        }
+
+        Node * bucket(size_t index) const
+        {
+            Buckets * t = table.load(std::memory_order_acquire);
+            if (index >= t->capacity) {
+                index -= t->capacity;
+                t = t->forward.load(std::memory_order_acquire);
+            }
+            Node * head = t->slots[index].load(std::memory_order_acquire);
+            return head == Buckets::moved() ? NULL : head;
+        }
+
+        template <typename Visitor>
+        void visitBucket(size_t index, Visitor & visitor) const
+        {
+            for (Node * c = bucket(index); c != NULL; c = c->getNext()) {
+                visitor(c->getKey(), c->getValue(), c->getDeadline());
+            }
+        }
+
+        // Visits the buckets of up to count cursor steps, starting at cursor,
+        // and returns the cursor to resume from, 0 once the segment is done.
+        // During a resize each step covers a bucket of the smaller array and
+        // every bucket of the larger one it maps to, so an entry is seen
+        // whichever side of the move it is on. Entries past their deadline
+        // at now are skipped (none for 0); a scan does not slide deadlines.
+        template <typename Visitor>
+        unsigned long scan(unsigned long cursor, Visitor & visitor, size_t count, const timemilliseconds & now) const
+        {
+            Buckets * small = table.load(std::memory_order_acquire);
+            Buckets * large = small->forward.load(std::memory_order_acquire);
+            if (large != NULL && large->capacity < small->capacity)
+                std::swap(small, large);
+
+            do {
+                size_t mask = small->capacity - 1;
+                visitChain(small->slots[cursor & mask].load(std::memory_order_acquire), visitor, now);
+                if (large == NULL) {
+                    cursor = scanNext(cursor, mask);
+                    continue;
+                }
+                size_t largeMask = large->capacity - 1;
+                do {
+                    visitChain(large->slots[cursor & largeMask].load(std::memory_order_acquire), visitor, now);
+                    cursor = scanNext(cursor, largeMask);
+                } while ((cursor & (mask ^ largeMask)) != 0);
+            } while (cursor != 0 && --count > 0);
+            return cursor;
+        }
+
+        const ResizeStats & resizeStats() const
+        {
+            return resizes;
+        }
+
+        bool rehashing() const
+        {
+            return table.load(std::memory_order_relaxed)->forward.load(std::memory_order_relaxed) != NULL;
+        }
+
+        // Stores V(args...) under key. A missing key is inserted, starting a
+        // resize when the segment crosses its threshold; a present one has its
+        // value replaced when assign is set and is left alone otherwise. An
+        // entry past its deadline at time.now counts as missing, here and in
+        // every other call taking a time. Returns true when a new entry was
+        // inserted.
+        template <typename KK, typename... Args>
+        bool emplace(unsigned long hashValue, bool assign, const EntryTime & time, KK && key, Args &&... args)
+        {
+            std::atomic<Node *> & head = writableTable(hashValue)->slot(hashValue);
+            Node * prev;
+            Node * entry = locateLive(head, hashValue, key, prev, time.now);
+            if (entry == NULL) {
+                insert(head, prev, hashValue, newNode(hashValue, time, std::forward<KK>(key), std::forward<Args>(args)...));
+                return true;
+            }
+            if (!assign)
+                return false;
+
+            if (readMode == ReadLockFree) {
+                entry = replace(head, prev, entry, newNode(hashValue, time, entry->getKey(), std::forward<Args>(args)...));
+            } else {
+                size_t before = weigh(entry);
+                assignValue(entry->getValue(), std::forward<Args>(args)...);
+                entry->setTime(time);
+                reweigh(entry, before);
+            }
+            schedule(entry, hashValue);
+            if (bounded())
+                evict();
+            return false;
+        }
+
+        // Runs fn(value, present) on the value stored under key and keeps the
+        // entry if it returns true, or removes it otherwise. A missing key
+        // starts from init() and is only inserted if fn keeps it; with a
+        // NoInsert init it is left missing. In ReadLockFree mode fn works on a
+        // copy that replaces the node. Returns true when the key is present
+        // afterwards.
+        template <typename Init, typename Fn>
+        bool compute(unsigned long hashValue, const K & key, const EntryTime & time, Init & init, Fn & fn)
+        {
+            std::atomic<Node *> & head = writableTable(hashValue)->slot(hashValue);
+            Node * prev;
+            Node * entry = locateLive(head, hashValue, key, prev, time.now);
+            if (entry == NULL)
+                return computeMissing(head, prev, hashValue, key, time, init, fn);
+
+            if (readMode == ReadLockFree) {
+                V value(entry->getValue());
+                if (!fn(value, true)) {
+                    unlink(head, prev, entry);
+                    checkShrink();
+                    return false;
+                }
+                entry = replace(head, prev, entry, newNode(hashValue, time, key, std::move(value)));
+            } else {
+                size_t before = weigh(entry);
+                if (!fn(entry->getValue(), true)) {
+                    unlink(head, prev, entry, before);
+                    checkShrink();
+                    return false;
+                }
+                entry->setTime(time);
+                reweigh(entry, before);
+            }
+            schedule(entry, hashValue);
+            if (bounded())
+                evict();
+            return true;
+        }
+
+        // Sizes the segment for entries entries in one go: any resize in
+        // progress is finished and the buckets are moved at once to an array
+        // that holds them all below the threshold.
+        void reserve(size_t entries)
+        {
+            if (entries < threshold)
+                return;
+            size_t capacity = newestTable()->capacity;
+            while (capacity * loadFactor <= entries)
+                capacity <<= 1;
+            startRehash(capacity);
+            finishRehash();
+        }
+
+        // Starts an incremental rebuild into the smallest array that holds
+        // the entries below the threshold, if that is smaller than the
+        // current one; later writes and advanceRehash() finish it. Returns
+        // true if a rebuild was started.
+        bool shrinkToFit()
+        {
+            size_t capacity = 1;
+            while (capacity * loadFactor <= m_size)
+                capacity <<= 1;
+            if (capacity >= newestTable()->capacity)
+                return false;
+            startRehash(capacity);
+            return true;
+        }
+
+        // Starts a shrink once the segment has emptied below the low-water
+        // mark, never during a resize or a batch, and returns true if it
+        // did. Removes call it; a helper driving advanceRehash() calls it
+        // too, so that a shrink started while removes ran out goes on.
+        bool checkShrink()
+        {
+            if (!autoShrink || batching || m_size >= threshold / shrinkDivisor)
+                return false;
+            Buckets * t = table.load(std::memory_order_relaxed);
+            if (t->capacity <= minCapacity || t->forward.load(std::memory_order_relaxed) != NULL)
+                return false;
+            size_t capacity = minCapacity;
+            while (capacity * loadFactor <= 4 * m_size)
+                capacity <<= 1;
+            if (capacity >= t->capacity)
+                return false;
+            startRehash(capacity);
+            return true;
+        }
+
+
+        // Inserts between beginBatch() and endBatch() check the resize
+        // threshold once, at the end of the batch. A batch of count keys
+        // that is sure to cross it reserves room up front instead, so its
+        // inserts do not walk overlong chains.
+        void beginBatch(size_t count)
+        {
+            batching = true;
+            reserve(m_size + count);
+        }
+
+        void endBatch()
+        {
+            batching = false;
+            checkResize();
+        }
+
+        // Batch lookups touch the bucket slot, then the chain head, a few keys
+        // ahead of the probe so that the cache misses overlap.
+        void prefetchBucket(unsigned long hashValue) const
+        {
+            __builtin_prefetch(&table.load(std::memory_order_acquire)->slot(hashValue));
+        }
+
+        void prefetchEntry(unsigned long hashValue) const
+        {
+            __builtin_prefetch(table.load(std::memory_order_acquire)->slot(hashValue).load(std::memory_order_acquire));
+        }
+
+        // Moves up to count old buckets into the new array; returns false once
+        // no resize is in progress.
+        bool advanceRehash(size_t count)
+        {
+            Buckets * t = table.load(std::memory_order_relaxed);
+            Buckets * next = t->forward.load(std::memory_order_relaxed);
+            if (next == NULL)
+                return false;
+
+            for (; count > 0 && migrateIndex < t->capacity; count--) {
+                migrateBucket(t, next, migrateIndex++);
+            }
+            if (migrateIndex >= t->capacity) {
+                table.store(next, std::memory_order_release);
+                resizes.moved += t->capacity;
+                resizes.finished(monotonicNanoseconds() - rehashStart);
+                dispose(t);
+                migrateIndex = 0;
+                return false;
+            }
+            return true;
+        }
+
+        void finishRehash()
+        {
+            while (advanceRehash(table.load(std::memory_order_relaxed)->capacity))
+                ;
+        }
+
+        // Lookups take any key type Q comparable with K, for the transparent
+        // hash functions.
+        template <typename Q>
+        Node * find(unsigned long hashValue, const Q & key) const
+        {
+            Buckets * t = table.load(std::memory_order_acquire);
+            Node *entry = t->slot(hashValue).load(std::memory_order_acquire);
+            while (entry == Buckets::moved()) {
+                t = t->forward.load(std::memory_order_acquire);
+                entry = t->slot(hashValue).load(std::memory_order_acquire);
+            }
+
+            while (entry != NULL) {
+                if (entry->matches(hashValue, key)) {
+                    return entry;
+                }
+
+                entry = entry->getNext();
+            }
+
+            return NULL;
+        }
+
+        // Fires up to limit of the expiry records due at now and appends the
+        // keys of the entries that have really expired, reporting each once
+        // and leaving it in place. Records of removed entries, and of
+        // entries refreshed since, are dropped or moved to the new deadline.
+        // Due records past the limit wait for the next call. Returns the
+        // number of records fired.
+        size_t collectExpired(const timemilliseconds & now, size_t limit, std::vector<K> & expired)
+        {
+            auto fire = [&](std::atomic<Node *> &, Node *, Node * node) {
+                // a later put() schedules it again
+                node->setScheduled(0);
+                expired.push_back(node->getKey());
+            };
+            return fireDue(now, limit, fire);
+        }
+
+        // Same as collectExpired(), but unlinks the expired entries and
+        // appends them as pairs.
+        size_t removeExpired(const timemilliseconds & now, size_t limit, std::vector<std::pair<K, V> > & expired)
+        {
+            auto fire = [&](std::atomic<Node *> & head, Node * prev, Node * node) {
+                // a lock-free reader may still be copying the value
+                if (readMode == ReadLockFree)
+                    expired.push_back(std::make_pair(node->getKey(), node->getValue()));
+                else
+                    expired.push_back(std::make_pair(node->getKey(), std::move(node->getValue())));
+                unlink(head, prev, node);
+            };
+            size_t fired = fireDue(now, limit, fire);
+            checkShrink();
+            return fired;
+        }
+
+        // Reads take the current time too, 0 when deadlines are not checked.
+        template <typename Q>
+        bool get(unsigned long hashValue, const Q & key, V & val, const timemilliseconds & now) const
+        {
+            Node * entry = find(hashValue, key);
+            if (entry == NULL || !entry->alive(now, sliding))
+                return false;
+            if (bounded())
+                entry->touch();
+            val = entry->getValue();
+            return true;
+        }
+
+        // Calls fn(value) on the stored value instead of copying it out.
+        template <typename Q, typename Fn>
+        bool visit(unsigned long hashValue, const Q & key, Fn & fn, const timemilliseconds & now) const
+        {
+            Node * entry = find(hashValue, key);
+            if (entry == NULL || !entry->alive(now, sliding))
+                return false;
+            if (bounded())
+                entry->touch();
+            fn(entry->getValue());
+            return true;
+        }
+
+        template <typename Q>
+        bool contain(unsigned long hashValue, const Q & key, const timemilliseconds & now) const
+        {
+            Node * entry = find(hashValue, key);
+            return entry != NULL && entry->alive(now, sliding);
+        }
+
+        template <typename Q>
+        bool remove(unsigned long hashValue, const Q & key, const timemilliseconds & now)
+        {
+            std::atomic<Node *> & head = writableTable(hashValue)->slot(hashValue);
+            Node * prev;
+            Node * entry = locateLive(head, hashValue, key, prev, now);
+            if (entry == NULL) {
+                // key not found
+                return false;
+            }
+            unlink(head, prev, entry);
+            checkShrink();
+            return true;
+        }
+
+        void clear()
+        {
+            finishRehash();
+            Buckets * t = table.load(std::memory_order_relaxed);
+            // readers may still be walking the old chains in ReadLockFree
+            // mode: publish an empty array and retire the old one with all
+            // of its nodes; a shrinking segment goes back to its first size
+            bool replace = readMode == ReadLockFree || (autoShrink && t->capacity > minCapacity);
+            if (replace) {
+                size_t capacity = autoShrink ? minCapacity : t->capacity;
+                table.store(new Buckets(capacity), std::memory_order_release);
+                threshold = capacity * loadFactor;
+            }
+            for (size_t j = 0; j < t->capacity; j++)
+            {
+                Node * node = t->slots[j].load(std::memory_order_relaxed);
+                Node * prev;
+                while (node != NULL) {
+                    prev = node;
+                    node = node->getNext();
+                    dispose(prev);
+                }
+                t->slots[j].store(NULL, std::memory_order_relaxed);
+            }
+            if (replace)
+                dispose(t);
+            if (wheel != NULL)
+                wheel->clear();
+            overdue.clear();
+            m_size.store(0, std::memory_order_relaxed);
+            bytes = 0;
+        }
+
+        ReadWriteMutex * mutex;
+
+    private:
+        // this segment's shard of the table size: only the writer holding
+        // the segment lock updates it, so it adds no shared line to a write
+        std::atomic<size_t> m_size;
+        float   loadFactor;
+        size_t  threshold;
+        // capacity auto-shrink stops at, the initial one
+        size_t  minCapacity;
+        bool    autoShrink;
+        ReadMode readMode;
+        // set while a batch defers the resize check to its end
+        bool    batching;
+        // next old bucket to move while a resize is in progress
+        size_t  migrateIndex;
+        long long rehashStart;
+        ResizeStats resizes;
+        // hash table; the array being filled by a resize hangs off its forward
+        std::atomic<Buckets *> table;
+        // expiry index of the entries with a deadline, once there are any
+        TimingWheel<ExpiryRecord<K> > * wheel;
+        // the records one fireDue() takes off the wheel, kept for its capacity
+        std::vector<ExpiryRecord<K> > overdue;
+        bool    sliding;
+        // cache bounds, 0 when off, and what the entries weigh now
+        size_t  maxEntries;
+        size_t  maxBytes;
+        size_t  bytes;
+        size_t  (* weigher)(const K &, const V &);
+        bool    keepEvicted;
+        // next bucket of the CLOCK hand
+        size_t  clockHand;
+        size_t  evictionCount;
+        std::vector<std::pair<K, V> > evicted;
+        // keeps the fields written by each write off the cache lines of the
+        // next segment in the table's array
+        char    padding[counterPadding];
+
+        template <typename... Args>
+        static Node * newNode(unsigned long hashValue, const EntryTime & time, Args &&... args)
+        {
+            return new (A::template allocate<Node>()) Node(hashValue, time, std::forward<Args>(args)...);
+        }
+
+        static void destroyNode(void * p)
+        {
+            static_cast<Node *>(p)->~HashNode();
+            A::template deallocate<Node>(p);
+        }
+
+        void dispose(Node * node)
+        {
+            if (readMode == ReadLockFree)
+                EpochManager::getInstance().retire(node, &HashSegment::destroyNode);
+            else
+                destroyNode(node);
+        }
+
+        void dispose(Buckets * array)
+        {
+            if (readMode == ReadLockFree)
+                EpochManager::getInstance().retire(array);
+            else
+                delete array;
+        }
+
+        Buckets * newestTable() const
+        {
+            Buckets * t = table.load(std::memory_order_relaxed);
+            Buckets * next = t->forward.load(std::memory_order_relaxed);
+            return next != NULL ? next : t;
+        }
+
+        // Advances a running resize and returns the array a write for
+        // hashValue must go to, moving that key's old bucket first.
+        Buckets * writableTable(unsigned long hashValue)
+        {
+            if (!advanceRehash(defaultRehashStep))
+                return table.load(std::memory_order_relaxed);
+
+            Buckets * t = table.load(std::memory_order_relaxed);
+            Buckets * next = t->forward.load(std::memory_order_relaxed);
+            migrateBucket(t, next, t->index(hashValue));
+            return next;
+        }
+
+        void startRehash(const size_t newCapacity)
+        {
+            // a segment that outgrows its next array before the previous
+            // resize is done completes that one first
+            finishRehash();
+            table.load(std::memory_order_relaxed)->forward.store(new Buckets(newCapacity), std::memory_order_release);
+            migrateIndex = 0;
+            threshold = newCapacity * loadFactor;
+            rehashStart = monotonicNanoseconds();
+        }
+
+        void migrateBucket(Buckets * from, Buckets * to, size_t index)
+        {
+            Node * entry = from->slots[index].load(std::memory_order_relaxed);
+            if (entry == Buckets::moved())
+                return;
+
+            while (entry != NULL) {
+                Node * next = entry->getNext();
+                std::atomic<Node *> & head = to->slot(entry->getHash());
+                if (readMode == ReadLockFree) {
+                    EntryTime time;
+                    time.deadline = entry->getDeadline();
+                    time.ttl = entry->getTtl();
+                    Node * copy = newNode(entry->getHash(), time, entry->getKey(), entry->getValue());
+                    copy->setScheduled(entry->getScheduled());
+                    copy->setReferenced(entry->isReferenced());
+                    copy->setNext(head.load(std::memory_order_relaxed));
+                    head.store(copy, std::memory_order_release);
+                    dispose(entry);
+                } else {
+                    entry->setNext(head.load(std::memory_order_relaxed));
+                    head.store(entry, std::memory_order_release);
+                }
+                entry = next;
+            }
+            from->slots[index].store(Buckets::moved(), std::memory_order_release);
+        }
+
+        template <typename Visitor>
+        static void visitChain(Node * entry, Visitor & visitor, const timemilliseconds & now)
+        {
+            if (entry == Buckets::moved())
+                return;
+            for (; entry != NULL; entry = entry->getNext())
+                if (entry->alive(now, false))
+                    visitor(entry->getKey(), entry->getValue(), entry->getDeadline());
+        }
+
+        // Returns the node holding key in the chain at head, or NULL, and
+        // leaves prev at the node before it (the chain tail when missing).
+        template <typename Q>
+        Node * locate(std::atomic<Node *> & head, unsigned long hashValue, const Q & key, Node *& prev) const
+        {
+            prev = NULL;
+            Node * entry = head.load(std::memory_order_relaxed);
+            while (entry != NULL && !entry->matches(hashValue, key)) {
+                prev = entry;
+                entry = entry->getNext();
+            }
+            return entry;
+        }
+
+        // Points prev (or head) at node.
+        static void relink(std::atomic<Node *> & head, Node * prev, Node * node)
+        {
+            if (prev == NULL)
+                head.store(node, std::memory_order_release);
+            else
+                prev->setNext(node);
+        }
+
+        // Appends a new node after prev, the chain tail.
+        void insert(std::atomic<Node *> & head, Node * prev, unsigned long hashValue, Node * node)
+        {
+            relink(head, prev, node);
+            schedule(node, hashValue);
+            m_size.store(m_size.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            if (bounded()) {
+                bytes += weigh(node);
+                // a new entry gets one turn of the hand before it can go
+                node->touch();
+                evict();
+            }
+            if (!batching)
+                checkResize();
+        }
+
+        void checkResize()
+        {
+            if (m_size >= threshold) {
+                // a batch may have gone past more than one threshold
+                startRehash(capacityFor(m_size));
+            }
+        }
+
+        // the next capacity, in steps of four, that holds count entries
+        size_t capacityFor(size_t count)
+        {
+            size_t capacity = newestTable()->capacity << 2;
+            while (capacity * loadFactor <= count)
+                capacity <<= 2;
+            return capacity;
+        }
+
+        // Takes at most limit records due at now off the wheel into overdue,
+        // then works through them, calling fire(head, prev, node) for the
+        // entries past their deadline.
+        template <typename Fire>
+        size_t fireDue(const timemilliseconds & now, size_t limit, Fire & fire)
+        {
+            if (wheel == NULL)
+                return 0;
+
+            wheel->advance(now, overdue, limit);
+            size_t fired = 0;
+            while (fired < limit && !overdue.empty()) {
+                ExpiryRecord<K> r(std::move(overdue.back()));
+                overdue.pop_back();
+                fired += 1;
+                std::atomic<Node *> & head = writableTable(r.hash)->slot(r.hash);
+                Node * prev;
+                Node * node = locate(head, r.hash, r.key, prev);
+                if (node == NULL || node->getScheduled() != r.deadline)
+                    continue;
+                timemilliseconds deadline = node->getDeadline();
+                if (deadline == 0) {
+                    // written without a deadline since
+                    node->setScheduled(0);
+                } else if (deadline <= now) {
+                    fire(head, prev, node);
+                } else {
+                    node->setScheduled(deadline);
+                    r.deadline = deadline;
+                    wheel->add(r);
+                }
+            }
+            return fired;
+        }
+
+        // Published nodes are immutable in ReadLockFree mode: updates link a
+        // replacement in the place of the old node.
+        Node * replace(std::atomic<Node *> & head, Node * prev, Node * entry, Node * replacement)
+        {
+            replacement->setScheduled(entry->getScheduled());
+            replacement->setReferenced(entry->isReferenced());
+            replacement->setNext(entry->getNext());
+            reweigh(replacement, weigh(entry));
+            relink(head, prev, replacement);
+            dispose(entry);
+            return replacement;
+        }
+
+        void unlink(std::atomic<Node *> & head, Node * prev, Node * entry)
+        {
+            unlink(head, prev, entry, weigh(entry));
+        }
+
+        // weight is what entry weighed when it was last accounted
+        void unlink(std::atomic<Node *> & head, Node * prev, Node * entry, size_t weight)
+        {
+            relink(head, prev, entry->getNext());
+            dispose(entry);
+            m_size.store(m_size.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+            bytes -= weight;
+        }
+
+        bool bounded() const
+        {
+            return maxEntries != 0 || maxBytes != 0;
+        }
+
+        bool overLimit() const
+        {
+            return (maxEntries != 0 && m_size > maxEntries) || (maxBytes != 0 && bytes > maxBytes);
+        }
+
+        // Weight of an entry for the byte limit; 0 when there is none.
+        size_t weigh(const Node * node) const
+        {
+            if (maxBytes == 0)
+                return 0;
+            return weigher != NULL ? weigher(node->getKey(), node->getValue()) : sizeof(Node);
+        }
+
+        void reweigh(const Node * node, size_t before)
+        {
+            if (maxBytes != 0)
+                bytes = bytes - before + weigh(node);
+        }
+
+        // CLOCK over the buckets of the current array: the hand gives an entry
+        // whose access bit is set a second chance, clearing the bit, and
+        // evicts the first one without, until the segment is within its
+        // bounds again. During a resize only the buckets not moved yet are
+        // candidates. Two turns without enough victims give up until the next
+        // write rather than stall it.
+        void evict()
+        {
+            Buckets * t = table.load(std::memory_order_relaxed);
+            for (size_t budget = 2 * t->capacity; overLimit() && budget > 0; budget--) {
+                std::atomic<Node *> & head = t->slots[clockHand++ & (t->capacity - 1)];
+                Node * prev = NULL;
+                Node * entry = head.load(std::memory_order_relaxed);
+                if (entry == Buckets::moved())
+                    continue;
+                while (entry != NULL && overLimit()) {
+                    Node * next = entry->getNext();
+                    if (entry->clearReferenced()) {
+                        prev = entry;
+                    } else {
+                        if (keepEvicted)
+                            evicted.push_back(std::make_pair(entry->getKey(), entry->getValue()));
+                        evictionCount += 1;
+                        unlink(head, prev, entry);
+                    }
+                    entry = next;
+                }
+            }
+        }
+
+        // Files a record for the deadline of node unless one due no later is
+        // pending: a deadline pushed out keeps its record, which reschedules
+        // it lazily when it fires, while one brought forward gets a new
+        // record and the old one is dropped when it fires.
+        void schedule(Node * node, unsigned long hashValue)
+        {
+            timemilliseconds deadline = node->getDeadline();
+            if (wheel != NULL && deadline != 0 && (node->getScheduled() == 0 || deadline < node->getScheduled())) {
+                node->setScheduled(deadline);
+                wheel->add(ExpiryRecord<K>(node->getKey(), hashValue, deadline));
+            }
+        }
+
+        // locate() for writers: an entry past its deadline at now is unlinked
+        // on the way and reported missing, with prev left at the new tail.
+        template <typename Q>
+        Node * locateLive(std::atomic<Node *> & head, unsigned long hashValue, const Q & key, Node *& prev, const timemilliseconds & now)
+        {
+            Node * entry = locate(head, hashValue, key, prev);
+            if (entry != NULL && !entry->alive(now, false)) {
+                unlink(head, prev, entry);
+                entry = locate(head, hashValue, key, prev);
+            }
+            return entry;
+        }
+
+        template <typename Init, typename Fn>
+        bool computeMissing(std::atomic<Node *> & head, Node * prev, unsigned long hashValue, const K & key, const EntryTime & time, Init & init, Fn & fn)
+        {
+            V value(init());
+            if (!fn(value, false))
+                return false;
+            insert(head, prev, hashValue, newNode(hashValue, time, key, std::move(value)));
+            return true;
+        }
+
+        template <typename Fn>
+        bool computeMissing(std::atomic<Node *> &, Node *, unsigned long, const K &, const EntryTime &, NoInsert &, Fn &)
+        {
+            return false;
+        }
+    };
+}
+#endif // HASHSEGMENT_H
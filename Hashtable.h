@@ -2,413 +2,1531 @@
 #define HASHTABLE_H
 
 #include <cstddef>
+#include <memory>
+#include <string>
 #include <utility>
+#include <type_traits>
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "Common.h"
 #include "Threads.h"
+#include <vector>
+
 #include "HashNode.h"
+#include "HashSegment.h"
+#include "FlatSegment.h"
+#include "HashtableStats.h"
+#include "Snapshot.h"
+#include "Combining.h"
+#include "ShardedCounter.h"
 
 namespace dt { 
          
     const int defaultCapacity = 100;
-    const float defaultLoadFactor = 0.75f;
+    const int defaultSegments = 16;
+    // keys a batch call prefetches ahead of the one it is probing
+    const size_t batchPrefetchDistance = 4;
+    // cursor steps of one scan() call, taken under one segment lock
+    const size_t defaultScanCount = 16;
+    // due expiry records one sweep handles per segment lock hold
+    const size_t defaultExpiryBatch = 128;
+    // due expiry records one sweep handles over all segments
+    const size_t defaultExpiryBudget = 65536;
+    // old buckets compact() moves per segment lock hold
+    const size_t compactStep = 1024;
+
+    // What happens to the entries past their deadline.
+    enum ExpiryMode {
+        // they stay readable; the sweep reports the key of each once
+        ExpireNotify,
+        // reads miss them at once and the sweep removes them, handing them
+        // out as key / value pairs
+        ExpireRemove
+    };
+
+    // sweep interval of tables without a period once entries have a TTL
+    const long defaultSweepMs = 1000;
+
+    // How put() and remove() get to the segment lock.
+    enum WriteMode {
+        // every writer takes the segment write lock itself
+        WriteLocked,
+        // flat combining: writers publish their operation, and whichever of
+        // them gets the lock applies all published ones in one pass
+        WriteCombining
+    };
+
+    // One key of a batch call: its hash and its position in the caller's arrays.
+    struct BatchEntry {
+        unsigned long   hash;
+        size_t          index;
+    };
     
-    extern timemilliseconds getMilliseconds(void) ;
 
-    template<typename K, typename V, typename F = KeyHash<K> >
+    // Construction parameters of a Hashtable. The capacity is split evenly
+    // over the segments, each of which is locked and rehashed on its own.
+    struct HashtableOptions {
+        int     capacity;
+        float   loadFactor;
+        int     periodSeconds;
+        int     segments;
+        ReadMode readMode;
+        // how often expired entries are swept; 0 sweeps once per period
+        long    sweepMs;
+        // clock the entry deadlines are taken from
+        TimeSource clock;
+        // Bounded cache mode: when set, inserts past maxEntries entries or
+        // maxBytes bytes evict entries by CLOCK. Both limits are split over
+        // the segments, whose shares add up to the limit unless it is below
+        // the segment count, where each segment still gets 1; 0 means no
+        // limit.
+        size_t  maxEntries;
+        size_t  maxBytes;
+        WriteMode writeMode;
+        ExpiryMode expiryMode;
+        // Sweeps handle at most expiryBatch due entries per segment lock
+        // hold and expiryBudget per run, leaving the rest for the next one;
+        // 0 means no limit.
+        size_t  expiryBatch;
+        size_t  expiryBudget;
+        // sliding TTL: every read of an entry pushes its deadline out to the
+        // time of the read plus the TTL it was written with
+        bool    slidingTtl;
+        // segments shrink back towards their share of capacity as they
+        // empty, with hysteresis (see shrinkDivisor), and clear() returns
+        // them to it
+        bool    autoShrink;
+
+        HashtableOptions() : capacity(defaultCapacity), loadFactor(defaultLoadFactor), periodSeconds(0), segments(defaultSegments), readMode(ReadLocked), sweepMs(0), clock(coarseMilliseconds), maxEntries(0), maxBytes(0), writeMode(WriteLocked),
+            expiryMode(ExpireRemove), expiryBatch(defaultExpiryBatch), expiryBudget(defaultExpiryBudget), slidingTtl(false),
+            autoShrink(true)
+        {
+        }
+    };
+
+    // Storage backends for Hashtable, chosen through its S template parameter.
+
+    // Separately allocated HashNode chains (the default), with nodes taken
+    // from the node allocator A: NewAllocator, or SlabAllocator<> to keep
+    // put / remove churn off the global heap (NodeAllocator.h). Timed nodes
+    // carry a deadline; tables that never expire anything can leave it out.
+    template <typename A = NewAllocator, bool Timed = true>
+    struct ChainedStorage {
+        template <typename K, typename V, typename F>
+        struct Segment {
+            typedef HashSegment<K, V, F, A, Timed> type;
+        };
+    };
+
+    // Chains of compact nodes, without the 24 bytes of expiry fields. Such a
+    // table keeps no deadlines: the period and per-entry TTLs are ignored.
+    template <typename A = NewAllocator>
+    using CompactStorage = ChainedStorage<A, false>;
+
+    // Flat open-addressing slots probed sixteen at a time (FlatSegment.h).
+    struct FlatStorage {
+        template <typename K, typename V, typename F>
+        struct Segment {
+            typedef FlatSegment<K, V, F> type;
+        };
+    };
+
+    template<typename K, typename V, typename F = KeyHash<K>, typename S = ChainedStorage<>, typename P = NoStats>
     class Hashtable;
 
-    template <typename K, typename V, typename F = KeyHash<K> >
+    // Walks all entries. Entries are copied out a few buckets at a time by
+    // Hashtable::scan(), so no pointer into the table is kept between calls,
+    // and a walk that overlaps a resize still sees every entry present
+    // throughout it (some possibly twice).
+    template <typename K, typename V, typename F = KeyHash<K>, typename S = ChainedStorage<>, typename P = NoStats>
     class Iterator
     {
       public :
-        Iterator(Hashtable<K, V, F> & table):hashtable(table),position (0), current(NULL) {       
+        Iterator(Hashtable<K, V, F, S, P> & table):hashtable(&table), current(0), cursor(0), done(false) {       
         }
         
-        Iterator (const Iterator & itr):hashtable(itr.hashtable), position(0), current(NULL) {            
+        Iterator (const Iterator & itr):hashtable(itr.hashtable), current(0), cursor(0), done(false) {            
         }
         
         void operator = ( const Iterator & itr) {
             hashtable = itr.hashtable;
-            position = itr.position;
+            buffer = itr.buffer;
+            cursor = itr.cursor;
+            done = itr.done;
             current = itr.current;
         }
         
         bool hasNext() {
-            ReadLock(hashtable.mutex);
-         
-            if (position >= hashtable.capacity)
-                return false;
-            
-            if (current != NULL) {
-                if (current->getNext() != NULL) {
-                    current = current->getNext();
-                    
-                    return true;
-                }
+            if (current + 1 < buffer.size()) {
+                current++;
+                return true;
             }
-            for (int j = position ; j < hashtable.capacity; j++) {
-                HashNode<K, V > * node = hashtable.table[j];
-                if (node != NULL) {
-                    current = node;
-                    position = j + 1;
-                    return true;
-                }
+            buffer.clear();
+            current = 0;
+
+            while (!done && buffer.empty()) {
+                cursor = hashtable->scanSegments(cursor, *this, defaultScanCount, hashtable->readTime());
+                done = cursor == 0;
             }
-            
-            return false;
+            return !buffer.empty();
         }
         
         void next(K & k, V & v){
-            if (current == NULL)
+            if (current >= buffer.size())
                 return;
             else {
-                k = current->getKey();
-                v = current->getValue();
+                k = buffer[current].first;
+                v = buffer[current].second;
             }
         } 
         
         void reset() {
-           current = NULL;
-           position = 0;
+           buffer.clear();
+           current = 0;
+           cursor = 0;
+           done = false;
+        }
+
+        // bucket visitor
+        void operator()(const K & k, const V & v, const timemilliseconds &) {
+            buffer.push_back(std::make_pair(k, v));
         }
         
         private:
-            Hashtable<K, V, F> & hashtable;
-            HashNode<K, V> * current;
-            size_t position;
+            Hashtable<K, V, F, S, P> * hashtable;
+            std::vector<std::pair<K, V> > buffer;
+            size_t current;
+            unsigned long cursor;
+            bool done;
     };
     
     
-    template <typename K, typename V, typename F = KeyHash<K> >
+    // Walks the entries past their deadline at basetime, with the same
+    // scan-based copying as Iterator.
+    template <typename K, typename V, typename F = KeyHash<K>, typename S = ChainedStorage<>, typename P = NoStats>
     class ExpiredIterator
     {
       public :
-        ExpiredIterator(Hashtable<K, V, F> & table, timemilliseconds & base):hashtable(table),position (0), current(NULL), basetime(base) {
+        ExpiredIterator(Hashtable<K, V, F, S, P> & table, timemilliseconds & base):hashtable(&table), current(0), basetime(base), cursor(0), done(false) {
                 
         }
         
-        ExpiredIterator (const ExpiredIterator & itr):hashtable(itr.hashtable), position(0), current(NULL), basetime(itr.basetime) {
+        ExpiredIterator (const ExpiredIterator & itr):hashtable(itr.hashtable), current(0), basetime(itr.basetime), cursor(0), done(false) {
             
         }
         
         void operator = ( const ExpiredIterator & itr) {
             hashtable = itr.hashtable;
-            position = itr.position;
+            buffer = itr.buffer;
+            basetime = itr.basetime;
+            cursor = itr.cursor;
+            done = itr.done;
             current = itr.current;
         }
         
         bool hasNext() {
-            ReadLock(hashtable.mutex);
-         
-            if (hashtable.periodSeconds == 0)
-                return false;
-            
-            if (position >= hashtable.capacity)
+            if (!hashtable->deadlines.load(std::memory_order_acquire))
                 return false;
-            
-            if (current != NULL) {
-                for (HashNode<K, V> * c = current->getNext(); c != NULL; c = c->getNext()) {
-                    if (isExpired(c)) {
-                       current = c;
-                       return true;
-                    }
-                }
-            }
-            for (int j = position ; j < hashtable.capacity; j++) {
-                HashNode<K, V > * node = hashtable.table[j];
-                for (HashNode<K, V> * c = node; c != NULL; c = c->getNext()) {
-                    if (isExpired(c)) {
-                        current = c;
-                        position = j + 1;
-                        return true;
-                    }
-                }
+
+            if (current + 1 < buffer.size()) {
+                current++;
+                return true;
             }
+            buffer.clear();
+            current = 0;
             
-            return false;
+            while (!done && buffer.empty()) {
+                cursor = hashtable->scanSegments(cursor, *this, defaultScanCount, 0);
+                done = cursor == 0;
+            }
+            return !buffer.empty();
         }
         
         
         void next(K & k, V & v){
-                if (current == NULL)
+                if (current >= buffer.size())
                     return;
                 else {
-                    k = current->getKey();
-                    v = current->getValue();
+                    k = buffer[current].first;
+                    v = buffer[current].second;
                 }
         } 
         
         void reset() {
-           current = NULL;
-           position = 0;
+           buffer.clear();
+           current = 0;
+           cursor = 0;
+           done = false;
+        }
+
+        // bucket visitor
+        void operator()(const K & k, const V & v, const timemilliseconds & deadline) {
+            if (isExpired(deadline))
+                buffer.push_back(std::make_pair(k, v));
         }
         
         private:
             
-            Hashtable<K, V, F> & hashtable;
-            HashNode<K, V> * current;
+            Hashtable<K, V, F, S, P> * hashtable;
+            std::vector<std::pair<K, V> > buffer;
+            size_t current;
             timemilliseconds basetime;
-            size_t position;
+            unsigned long cursor;
+            bool done;
             
-            bool isExpired(HashNode<K, V> * node) {
-                return basetime - node->getTime() > hashtable.periodSeconds * 1000;
+            bool isExpired(const timemilliseconds & deadline) {
+                return deadline != 0 && deadline <= basetime;
             }
     };
     
-    template <typename K, typename V, typename F>
+    template <typename K, typename V, typename F, typename S, typename P>
     void expire(void * para);
     
-    template <typename K, typename V, typename F >
+    // P is the stats policy: NoStats (the default, free) or CollectStats,
+    // which makes stats() report operation counts, lock waits and sweeps.
+    template <typename K, typename V, typename F, typename S, typename P>
     class Hashtable : noncopyable
     {
-            template <typename X, typename Y, typename Z>
+            template <typename X, typename Y, typename Z, typename W, typename U>
             friend class Iterator;
             
-            template <typename X, typename Y, typename Z>
+            template <typename X, typename Y, typename Z, typename W, typename U>
             friend class ExpiredIterator;
         
-            template <typename X, typename Y, typename Z>
+            template <typename X, typename Y, typename Z, typename W, typename U>
             friend void expire(void * para);
        public :
-            Hashtable(): timerId(NULL), m_size(0), capacity(defaultCapacity), loadFactor(defaultLoadFactor), threshold(defaultCapacity * defaultLoadFactor), periodSeconds(0)
+            typedef typename S::template Segment<K, V, F>::type SegmentType;
+
+            // enables the overloads taking another key type than K
+            template <typename Q>
+            using Heterogeneous = typename std::enable_if<IsTransparent<F>::value && !std::is_same<Q, K>::value, int>::type;
+
+            Hashtable(): timerId(0), expiredFunc(NULL), evictedFunc(NULL), expiredBatchFunc(NULL)
             {
-                mutex = new ReadWriteMutex();
-                initTable();
+                init(HashtableOptions());
+                startSweep();
             }
             
-            Hashtable(int initCapability):timerId(NULL), m_size(0), capacity(initCapability), loadFactor(defaultLoadFactor), threshold(initCapability * defaultLoadFactor), periodSeconds(0)
+            Hashtable(int initCapability):timerId(0), expiredFunc(NULL), evictedFunc(NULL), expiredBatchFunc(NULL)
             {
-                mutex = new ReadWriteMutex();
-                initTable();
+                HashtableOptions options;
+                options.capacity = initCapability;
+                init(options);
+                startSweep();
             }
             
-            Hashtable(int initCapability, float factor, int p = 0, void (*func)(K &) = NULL):timerId(NULL), m_size(0), capacity(initCapability), loadFactor(factor), threshold(initCapability * factor), periodSeconds(p), expiredFunc(func)
+            Hashtable(int initCapability, float factor, int p = 0, void (*func)(K &) = NULL, int segments = defaultSegments):timerId(0), expiredFunc(func), evictedFunc(NULL), expiredBatchFunc(NULL)
             {
-                mutex = new ReadWriteMutex();
-                initTable();
-                if (periodSeconds == 0)
-                    timerId = NULL;
-                else {
-                ;
-                    timerId = Timer::getInstance().create(periodSeconds, periodSeconds, expire<K, V, F>, this);
-                }
+                HashtableOptions options;
+                options.capacity = initCapability;
+                options.loadFactor = factor;
+                options.periodSeconds = p;
+                options.segments = segments;
+                init(options);
+                startSweep();
+            }
+            
+            // evicted is called with every entry a bounded table evicts, after
+            // the segment lock is released. weigher gives the size of an
+            // entry for maxBytes; without one every entry counts its node.
+            // In ExpireRemove mode expiredBatch receives the removed entries,
+            // one batch per segment lock hold of the sweep, on the timer
+            // thread (or a Timer worker) with no lock held; it may move them
+            // out. Without it func gets their keys.
+            Hashtable(const HashtableOptions & options, void (*func)(K &) = NULL, void (*evicted)(K &, V &) = NULL,
+                      size_t (*weigher)(const K &, const V &) = NULL,
+                      void (*expiredBatch)(std::vector<std::pair<K, V> > &) = NULL):timerId(0), expiredFunc(func), evictedFunc(evicted), expiredBatchFunc(expiredBatch)
+            {
+                init(options, weigher);
+                startSweep();
             }
             
+            // Builds the table from the pairs in [first, last), a random access
+            // range of std::pair<K, V> or alike, with up to threads threads:
+            // keys are hashed and partitioned by segment in parallel, then
+            // every segment is sized once and filled by one thread without
+            // any lock, all with a single clock reading. The table is only
+            // visible to others, the expiry sweep included, once built.
+            // When a key repeats, the last pair wins.
+            template <typename It>
+            Hashtable(const HashtableOptions & options, It first, It last, int threads, void (*func)(K &) = NULL):timerId(0), expiredFunc(func), evictedFunc(NULL), expiredBatchFunc(NULL)
+            {
+                init(options);
+                bulkLoad(first, last, threads);
+                startSweep();
+            }
+
             ~Hashtable()
             {
-                clear();
-                delete [] table;
-                delete mutex;
-                if (timerId != NULL) {
-                    printf ("timer = %p\n", timerId);
+                if (timerId != 0) {
                     Timer::getInstance().remove(timerId);
                 }
+                delete [] segments;
+                delete [] combiners;
+                delete lookups;
             }
         
-            size_t size()
+            // Adds up the entry counts of the segments without locking, so it
+            // never waits for a writer; with writes going on it may be off
+            // by the ones in flight.
+            size_t size() const
             {
-                ReadLock lock(mutex);
-                return m_size;
+                size_t total = 0;
+                for (size_t i = 0; i < segmentCount; i++)
+                    total += segments[i].size();
+                return total;
+            }
+
+            // The entry count at one instant: every segment is read locked
+            // at once, in order, so writers stall for the length of the sum.
+            size_t exactSize()
+            {
+                std::vector<std::unique_ptr<SegmentReadLock> > locks(segmentCount);
+                for (size_t i = 0; i < segmentCount; i++)
+                    locks[i].reset(new SegmentReadLock(counters, segments[i].mutex));
+                size_t total = 0;
+                for (size_t i = 0; i < segmentCount; i++)
+                    total += segments[i].size();
+                return total;
             }
             
             void        put(const K & key, const V & val)
             {
-                WriteLock lock(mutex);
-                timemilliseconds mill = getMilliseconds();
-                bool update = putEntryInternal(table, capacity, key , val, mill);
-                if (!update)
-                    m_size += 1;
-                if (m_size >= threshold) {
-                    size_t newcapacity = capacity <<2;
-                    rehash(newcapacity);
-                }
+                if (combiners != NULL)
+                    combine(CombinePut, key, &val);
+                else
+                    insertOrAssign(key, val);
             }
-            
+
+            // In WriteCombining mode the key and value are copied, not moved:
+            // the combiner only sees them through the publication slot.
+            void        put(K && key, V && val)
+            {
+                if (combiners != NULL)
+                    combine(CombinePut, key, &val);
+                else
+                    insertOrAssign(std::move(key), std::move(val));
+            }
+
+            // Stores val under key with a TTL of its own: reads miss the entry
+            // ttlMs milliseconds later and the sweep removes it. 0 gives the
+            // table period (no deadline without one). Tables without a
+            // period start their expiry sweep on the first such put.
+            void        put(const K & key, const V & val, long long ttlMs)
+            {
+                store(entryTime(ttlMs), true, key, val);
+            }
+
+            // Same, with the deadline given on the table clock, which counts
+            // milliseconds like monotonicMilliseconds(). A deadline already
+            // past stores an entry that reads as missing.
+            void        putUntil(const K & key, const V & val, const timemilliseconds & deadline)
+            {
+                startExpiry();
+                store(timing(clock(), deadline), true, key, val);
+            }
+
+            // Stores val under key, inserting or replacing. Returns true when
+            // the key was inserted.
+            template <typename VV>
+            bool        insertOrAssign(const K & key, VV && val)
+            {
+                return store(entryTime(), true, key, std::forward<VV>(val));
+            }
+
+            template <typename VV>
+            bool        insertOrAssign(K && key, VV && val)
+            {
+                return store(entryTime(), true, std::move(key), std::forward<VV>(val));
+            }
+
+            // Stores V(args...), constructed in place, under key, inserting or
+            // replacing. Returns true when the key was inserted.
+            template <typename... Args>
+            bool        emplace(const K & key, Args &&... args)
+            {
+                return store(entryTime(), true, key, std::forward<Args>(args)...);
+            }
+
+            template <typename... Args>
+            bool        emplace(K && key, Args &&... args)
+            {
+                return store(entryTime(), true, std::move(key), std::forward<Args>(args)...);
+            }
+
+            // Inserts V(args...) only when key is missing; args are left
+            // untouched otherwise. Returns true when the key was inserted.
+            template <typename... Args>
+            bool        tryEmplace(const K & key, Args &&... args)
+            {
+                return store(entryTime(), false, key, std::forward<Args>(args)...);
+            }
+
+            template <typename... Args>
+            bool        tryEmplace(K && key, Args &&... args)
+            {
+                return store(entryTime(), false, std::move(key), std::forward<Args>(args)...);
+            }
+
+            // Calls fn(V & value, bool present) under the segment write lock.
+            // A missing key starts from V(). The entry is kept (or inserted) if
+            // fn returns true and removed otherwise. Returns true when the key
+            // is present afterwards.
+            template <typename Fn>
+            bool        compute(const K & key, Fn fn)
+            {
+                auto init = []() { return V(); };
+                return update(key, init, fn);
+            }
+
+            // Like compute(), for present keys only: fn(V & value) returns
+            // whether to keep the entry.
+            template <typename Fn>
+            bool        computeIfPresent(const K & key, Fn fn)
+            {
+                NoInsert init;
+                auto call = [&](V & value, bool) { return fn(value); };
+                return update(key, init, call);
+            }
+
+            // Inserts val when key is missing, and otherwise combines the
+            // stored value with it through fn(V & current, const V & val),
+            // which returns whether to keep the entry. Returns true when the
+            // key is present afterwards.
+            template <typename Fn>
+            bool        merge(const K & key, const V & val, Fn fn)
+            {
+                auto init = [&]() { return val; };
+                auto call = [&](V & current, bool present) { return !present || fn(current, val); };
+                return update(key, init, call);
+            }
+
             bool        get(const K & key, V & val)
             {
-                    ReadLock lock(mutex);
-                    unsigned long hashValue = hashFunc(key, capacity);
-                    HashNode<K, V> *entry = table[hashValue];
+                return lookup(key, [&](SegmentType & seg, unsigned long hashValue, const timemilliseconds & now) { return seg.get(hashValue, key, val, now); });
+            }
 
-                    while (entry != NULL) {
-                        if (entry->getKey() == key) {
-                            val =  entry->getValue();
-                            return true;
-                        }
+            // With a transparent hash function (KeyHash<std::string> is one),
+            // get, visit, contain and remove also take keys of another type
+            // comparable with K, such as a string_view or a C string.
+            template <typename Q, Heterogeneous<Q> = 0>
+            bool        get(const Q & key, V & val)
+            {
+                return lookup(key, [&](SegmentType & seg, unsigned long hashValue, const timemilliseconds & now) { return seg.get(hashValue, key, val, now); });
+            }
 
-                        entry = entry->getNext();
-                    }
+            // Calls fn(const V & value) on the stored value instead of copying
+            // it out; fn must not call back into the table.
+            template <typename Fn>
+            bool        visit(const K & key, Fn fn)
+            {
+                return lookup(key, [&](SegmentType & seg, unsigned long hashValue, const timemilliseconds & now) { return seg.visit(hashValue, key, fn, now); });
+            }
 
-                    return false;
+            template <typename Q, typename Fn, Heterogeneous<Q> = 0>
+            bool        visit(const Q & key, Fn fn)
+            {
+                return lookup(key, [&](SegmentType & seg, unsigned long hashValue, const timemilliseconds & now) { return seg.visit(hashValue, key, fn, now); });
             }
-            
-            bool        contain(const K & key)
+
+            // Looks up count keys at once; found[i] tells whether values[i] was
+            // filled. Keys are grouped by segment, each segment is locked once,
+            // and buckets are prefetched ahead of the probe. Returns the number
+            // of keys found.
+            size_t      multiGet(const K * keys, size_t count, V * values, bool * found)
             {
-                ReadLock lock(mutex);
-                unsigned long hashValue = hashFunc(key, capacity);
-                HashNode<K, V> *entry = table[hashValue];
+                std::vector<BatchEntry> batch;
+                std::vector<size_t> starts;
+                plan(keys, count, batch, starts);
 
-                while (entry != NULL) {
-                    if (entry->getKey() == key) {
-                        return true;
+                size_t hits = 0;
+                timemilliseconds now = readTime();
+                auto lookup = [&](SegmentType & seg, const BatchEntry & e) {
+                    found[e.index] = seg.get(e.hash, keys[e.index], values[e.index], now);
+                    if (found[e.index])
+                        hits += 1;
+                };
+                for (size_t i = 0; i < segmentCount; i++) {
+                    if (starts[i] == starts[i + 1])
+                        continue;
+                    if (lockFreeReads()) {
+                        EpochGuard guard;
+                        runBatch(segments[i], &batch[starts[i]], starts[i + 1] - starts[i], lookup);
+                    } else {
+                        SegmentReadLock lock(counters, segments[i].mutex);
+                        runBatch(segments[i], &batch[starts[i]], starts[i + 1] - starts[i], lookup);
                     }
+                }
+                counted(count, hits);
+                return hits;
+            }
+
+            // Stores values[i] under keys[i] for every i, taking each segment
+            // lock once and checking each segment for a resize once. When a
+            // key repeats, the last value wins.
+            void        multiPut(const K * keys, const V * values, size_t count)
+            {
+                std::vector<BatchEntry> batch;
+                std::vector<size_t> starts;
+                plan(keys, count, batch, starts);
+
+                EntryTime mill = entryTime();
+                size_t inserted = 0;
+                std::vector<std::pair<K, V> > gone;
+                auto store = [&](SegmentType & seg, const BatchEntry & e) {
+                    if (seg.emplace(e.hash, true, mill, keys[e.index], values[e.index]))
+                        inserted += 1;
+                };
+                for (size_t i = 0; i < segmentCount; i++) {
+                    if (starts[i] == starts[i + 1])
+                        continue;
+                    SegmentWriteLock lock(counters, segments[i].mutex);
+                    segments[i].beginBatch(starts[i + 1] - starts[i]);
+                    runBatch(segments[i], &batch[starts[i]], starts[i + 1] - starts[i], store);
+                    segments[i].endBatch();
+                    segments[i].takeEvicted(gone);
+                }
+                counters.count(StatPuts, count);
+                counters.count(StatInserts, inserted);
+                notifyEvicted(gone);
+            }
 
-                    entry = entry->getNext();
+            // Removes count keys, taking each segment lock once. Returns the
+            // number of keys removed.
+            size_t      multiRemove(const K * keys, size_t count)
+            {
+                std::vector<BatchEntry> batch;
+                std::vector<size_t> starts;
+                plan(keys, count, batch, starts);
+
+                size_t removed = 0;
+                timemilliseconds now = readTime();
+                auto erase = [&](SegmentType & seg, const BatchEntry & e) {
+                    if (seg.remove(e.hash, keys[e.index], now))
+                        removed += 1;
+                };
+                for (size_t i = 0; i < segmentCount; i++) {
+                    if (starts[i] == starts[i + 1])
+                        continue;
+                    SegmentWriteLock lock(counters, segments[i].mutex);
+                    runBatch(segments[i], &batch[starts[i]], starts[i + 1] - starts[i], erase);
                 }
+                counters.count(StatRemoves, count);
+                counters.count(StatRemoved, removed);
+                return removed;
+            }
 
-                return false;
+            bool        contain(const K & key)
+            {
+                return lookup(key, [&](SegmentType & seg, unsigned long hashValue, const timemilliseconds & now) { return seg.contain(hashValue, key, now); });
             }
-            
+
+            template <typename Q, Heterogeneous<Q> = 0>
+            bool        contain(const Q & key)
+            {
+                return lookup(key, [&](SegmentType & seg, unsigned long hashValue, const timemilliseconds & now) { return seg.contain(hashValue, key, now); });
+            }
+
             bool        remove(const K & key)
             {
-                WriteLock lock(mutex);
-                unsigned long hashValue = hashFunc(key, capacity);
-                HashNode<K, V> *prev = NULL;
-                HashNode<K, V> *entry = table[hashValue];
+                if (combiners != NULL)
+                    return combine(CombineRemove, key, NULL);
+                return erase(key);
+            }
+
+            template <typename Q, Heterogeneous<Q> = 0>
+            bool        remove(const Q & key)
+            {
+                return erase(key);
+            }
+            
+            void        clear()
+            {
+                for (size_t i = 0; i < segmentCount; i++) {
+                    WriteLock lock(segments[i].mutex);
+                    segments[i].clear();
+                }
+            }
+
+            // Sizes the table for n entries at once, so that filling it does
+            // not go through a chain of resizes. Each segment gets its share.
+            void        reserve(size_t n)
+            {
+                size_t perSegment = (n + segmentCount - 1) / segmentCount;
+                for (size_t i = 0; i < segmentCount; i++) {
+                    WriteLock lock(segments[i].mutex);
+                    segments[i].reserve(perSegment);
+                }
+            }
+
+            // Starts rebuilding every segment into the smallest bucket array
+            // that holds its entries, e.g. after a mass deletion. Chained
+            // segments rebuild incrementally, relinking their nodes as later
+            // writes and advanceRehash() move the buckets; flat segments
+            // rebuild at once and drop their tombstones.
+            void        shrinkToFit()
+            {
+                for (size_t i = 0; i < segmentCount; i++) {
+                    SegmentWriteLock lock(counters, segments[i].mutex);
+                    segments[i].shrinkToFit();
+                }
+            }
+
+            // shrinkToFit(), then finishes the rebuilds right away, holding
+            // each segment lock for compactStep buckets at a time.
+            void        compact()
+            {
+                shrinkToFit();
+                while (advanceRehash(compactStep))
+                    ;
+            }
+
+            // Moves up to bucketsPerSegment old buckets in every segment that
+            // is resizing, so a background helper can finish resizes started
+            // by put() without waiting for more writes, and starts the next
+            // shrink of a segment still below its low-water mark once the
+            // last one is done. Returns true while some segment still has
+            // buckets left to move.
+            bool        advanceRehash(size_t bucketsPerSegment = defaultRehashStep)
+            {
+                bool pending = false;
+                for (size_t i = 0; i < segmentCount; i++) {
+                    WriteLock lock(segments[i].mutex);
+                    if (segments[i].advanceRehash(bucketsPerSegment) || segments[i].checkShrink())
+                        pending = true;
+                }
+                return pending;
+            }
+
+            // Slab usage of the node allocator selected through S.
+            SlabStats   allocatorStats() const
+            {
+                return SegmentType::allocatorStats();
+            }
+
+            size_t      segmentsCount() const
+            {
+                return segmentCount;
+            }
+
+            // Snapshot of the table statistics. The chain histogram walks every
+            // bucket under the segment read locks, so this is meant for
+            // occasional scraping, not for hot paths.
+            HashtableStats stats()
+            {
+                struct ChainLength {
+                    size_t length;
+                    void operator()(const K &, const V &, const timemilliseconds &) {
+                        length += 1;
+                    }
+                };
 
-                while (entry != NULL && entry->getKey() != key) {
-                    prev = entry;
-                    entry = entry->getNext();
+                HashtableStats s;
+                counters.fill(s);
+                if (lookups != NULL) {
+                    s.gets = lookups->approximate(StatGets);
+                    s.hits = lookups->approximate(StatHits);
+                    s.misses = s.gets - s.hits;
                 }
+                ChainLength chain;
+                for (size_t i = 0; i < segmentCount; i++) {
+                    SegmentType & seg = segments[i];
+                    ReadLock lock(seg.mutex);
+                    s.entries += seg.size();
+                    s.evictions += seg.evictions();
+                    const ResizeStats & r = seg.resizeStats();
+                    s.resizes += r.resizes;
+                    s.moved += r.moved;
+                    s.resizeNs += r.resizeNs;
+                    if (r.maxResizeNs > s.maxResizeNs)
+                        s.maxResizeNs = r.maxResizeNs;
+
+                    size_t buckets = seg.bucketCount();
+                    for (size_t b = 0; b < buckets; b++) {
+                        chain.length = 0;
+                        seg.visitBucket(b, chain);
+                        s.chainLengths[chain.length < statsChainBuckets ? chain.length : statsChainBuckets] += 1;
+                        if (chain.length > 0)
+                            s.usedBuckets += 1;
+                        if (chain.length > s.maxChain)
+                            s.maxChain = chain.length;
+                    }
+                    s.buckets += buckets;
+                }
+                return s;
+            }
 
-                if (entry == NULL) {
-                    // key not found
+            // Writes every entry to a snapshot file at path, through a temporary
+            // file renamed into place once complete. The table keeps serving
+            // meanwhile: each segment is copied under its read lock and
+            // written out after the lock is released, so the snapshot is
+            // consistent per segment, not across segments. Deadlines are
+            // stored as the time left, so expiry resumes where it was after a
+            // load; entries already past theirs are left out.
+            bool        saveSnapshot(const char * path)
+            {
+                std::string tmp = std::string(path) + ".tmp";
+                FILE * file = fopen(tmp.c_str(), "wb");
+                if (file == NULL) {
+                    printf("snapshot: cannot create %s\n", tmp.c_str());
                     return false;
+                }
 
-                } else {
-                    if (prev == NULL) {
-                        // remove first bucket of the list
-                        table[hashValue] = entry->getNext();
+                struct Writer {
+                    std::string * out;
+                    timemilliseconds now;
+                    uint64_t count;
+                    void operator()(const K & key, const V & value, const timemilliseconds & deadline) {
+                        if (deadline != 0 && deadline <= now)
+                            return;
+                        long long remaining = deadline != 0 ? deadline - now : 0;
+                        Serializer<K>::write(*out, key);
+                        Serializer<V>::write(*out, value);
+                        Serializer<long long>::write(*out, remaining);
+                        count += 1;
+                    }
+                };
 
-                    } else {
-                        prev->setNext(entry->getNext());
+                SnapshotHeader header;
+                memcpy(header.magic, snapshotMagic, sizeof(header.magic));
+                header.version = snapshotVersion;
+                header.headerSize = sizeof(SnapshotHeader);
+                header.count = 0;
+                header.keySize = sizeof(K);
+                header.valueSize = sizeof(V);
+                bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+                std::string buffer;
+                Writer writer;
+                writer.out = &buffer;
+                writer.now = clock();
+                writer.count = 0;
+                for (size_t i = 0; i < segmentCount && ok; i++) {
+                    buffer.clear();
+                    {
+                        SegmentReadLock lock(counters, segments[i].mutex);
+                        size_t buckets = segments[i].bucketCount();
+                        for (size_t b = 0; b < buckets; b++)
+                            segments[i].visitBucket(b, writer);
                     }
+                    ok = fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+                }
 
-                    delete entry;
-                    m_size -= 1;
-                    return true;
-                }   
+                header.count = writer.count;
+                ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1
+                     && fflush(file) == 0 && fsync(fileno(file)) == 0;
+                ok = fclose(file) == 0 && ok;
+                if (!ok || rename(tmp.c_str(), path) != 0) {
+                    printf("snapshot: cannot write %s\n", path);
+                    unlink(tmp.c_str());
+                    return false;
+                }
+                return true;
             }
-            
-            void        clear()
+
+            // Adds the entries of a snapshot written by saveSnapshot(),
+            // replacing the values of keys already present. The file is
+            // mapped and decoded in one pass outside any lock; then every
+            // segment is locked once, sized once for its share and filled,
+            // with a single clock reading for all entries. An entry gets its
+            // saved time left as deadline and TTL, starting the expiry sweep
+            // if the table has none yet. A file that does not check out
+            // leaves the table untouched.
+            bool        loadSnapshot(const char * path)
             {
-                mutex = new ReadWriteMutex();
-                for (size_t j = 0; j<capacity; j++)
-                {
-                    HashNode<K, V> * node = table[j];
-                    HashNode<K, V> * prev;
-                    while (node != NULL) {
-                        prev = node;
-                        node = node->getNext();
-                        delete prev;
+                int fd = open(path, O_RDONLY);
+                if (fd < 0) {
+                    printf("snapshot: cannot open %s\n", path);
+                    return false;
+                }
+                struct stat st;
+                if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+                    printf("snapshot: %s is not a snapshot\n", path);
+                    close(fd);
+                    return false;
+                }
+                size_t length = st.st_size;
+                void * map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                close(fd);
+                if (map == MAP_FAILED) {
+                    printf("snapshot: cannot map %s\n", path);
+                    return false;
+                }
+                madvise(map, length, MADV_SEQUENTIAL);
+
+                std::vector<std::vector<LoadedEntry> > bySegment;
+                bool ok = decode(static_cast<const char *>(map), length, bySegment);
+                munmap(map, length);
+                if (!ok) {
+                    printf("snapshot: %s is truncated or does not match the table\n", path);
+                    return false;
+                }
+
+                bool timed = false;
+                for (size_t i = 0; i < segmentCount && !timed; i++)
+                    for (size_t j = 0; j < bySegment[i].size() && !timed; j++)
+                        timed = bySegment[i][j].remaining != 0;
+                if (timed)
+                    startExpiry();
+                timemilliseconds now = clock();
+                std::vector<std::pair<K, V> > gone;
+                for (size_t i = 0; i < segmentCount; i++) {
+                    std::vector<LoadedEntry> & entries = bySegment[i];
+                    if (entries.empty())
+                        continue;
+                    SegmentWriteLock lock(counters, segments[i].mutex);
+                    segments[i].beginBatch(entries.size());
+                    for (size_t j = 0; j < entries.size(); j++) {
+                        LoadedEntry & e = entries[j];
+                        segments[i].emplace(e.hash, true, timing(now, e.remaining != 0 ? now + e.remaining : 0), std::move(e.key), std::move(e.value));
                     }
+                    segments[i].endBatch();
+                    segments[i].takeEvicted(gone);
                 }
-                m_size = 0;
+                notifyEvicted(gone);
+                return true;
+            }
+
+            // SCAN in the manner of Redis: calls fn(key, value) for the entries
+            // of about count buckets of one segment, under a single read lock,
+            // and returns the cursor for the next call. Start with 0 and stop
+            // when 0 comes back. An entry present from the first call to the
+            // last is seen at least once even if its segment resizes in
+            // between; entries added or removed meanwhile may or may not be.
+            // Like get(), it skips entries past their deadline. fn must not
+            // write to the table.
+            template <typename Fn>
+            unsigned long scan(unsigned long cursor, Fn fn, size_t count = defaultScanCount)
+            {
+                auto visit = [&](const K & key, const V & value, const timemilliseconds &) { fn(key, value); };
+                return scanSegments(cursor, visit, count, readTime());
             }
-            Iterator<K, V, F> keys()
+
+            // Calls fn(key, value) for every entry from up to threads worker
+            // threads, which take whole segments in turn and scan each one
+            // as scan() does; the parallelism is bounded by the segment
+            // count. fn runs concurrently with itself and under a segment
+            // read lock, so it must be thread safe and must not write to the
+            // table. Returns once every segment is done.
+            template <typename Fn>
+            void        parallelForEach(Fn fn, int threads)
+            {
+                auto visit = [&](const K & key, const V & value, const timemilliseconds &) { fn(key, value); };
+                timemilliseconds now = readTime();
+                auto scanSegment = [&](size_t segment) {
+                    unsigned long cursor = 0;
+                    do {
+                        SegmentReadLock lock(counters, segments[segment].mutex);
+                        cursor = segments[segment].scan(cursor, visit, defaultScanCount, now);
+                    } while (cursor != 0);
+                };
+                parallel(segmentCount, threads, scanSegment);
+            }
+
+            Iterator<K, V, F, S, P> keys()
             {
-                return Iterator<K,V, F>(*this);
+                return Iterator<K, V, F, S, P>(*this);
             }
             
-            ExpiredIterator<K, V, F> expiredKeys()
+            ExpiredIterator<K, V, F, S, P> expiredKeys()
             {
-                 timemilliseconds milliseconds = getMilliseconds();
-                return ExpiredIterator<K,V, F>(*this, milliseconds);
+                timemilliseconds milliseconds = clock();
+                return ExpiredIterator<K, V, F, S, P>(*this, milliseconds);
             }
             
         private :
-            timer_t  timerId;
-            ReadWriteMutex * mutex;
-            size_t  m_size;
-            int     capacity;
-            float   loadFactor;
-            int     threshold;
+            // segment locks that report their waits to the stats policy
+            typedef StatsLock<P, ReadLock, false> SegmentReadLock;
+            typedef StatsLock<P, WriteLock, true> SegmentWriteLock;
+
+            TimerId  timerId;
             int     periodSeconds;
+            long    sweepMs;
+            // set once some entry may have a deadline; guarded by expiryMutex
+            // until then
+            std::atomic<bool> deadlines;
+            Mutex   expiryMutex;
+            ReadMode readMode;
+            TimeSource clock;
             F       hashFormula;
             void    (*expiredFunc)(K &);
-            // hash table
-            HashNode<K, V> ** table ;
+            void    (*evictedFunc)(K &, V &);
+            void    (*expiredBatchFunc)(std::vector<std::pair<K, V> > &);
+            ExpiryMode expiryMode;
+            size_t  expiryBatch;
+            size_t  expiryBudget;
+            // segment the next sweep starts from, where the last one ran out
+            // of budget
+            size_t  expiryCursor;
+            // independently locked segments, a power of two in number
+            SegmentType * segments;
+            size_t  segmentCount;
+            size_t  segmentMask;
+            P       counters;
+            // one publication list per segment in WriteCombining mode, else NULL
+            CombineQueue<K, V> * combiners;
+            // gets and hits of a bounded table whose stats policy does not
+            // count them, indexed by StatGets and StatHits; else NULL
+            ShardedCounter<StatHits + 1> * lookups;
             
-            void          initTable()
+            void          init(const HashtableOptions & options, size_t (*weigher)(const K &, const V &) = NULL)
             {
-              table = new HashNode<K, V> * [capacity];
-              for (size_t i = 0; i<capacity; i++) {
-                    table[i] = NULL;
-              }   
+                periodSeconds = options.periodSeconds;
+                if (periodSeconds != 0 && !SegmentType::timed) {
+                    printf("hashtable: storage without deadlines, period ignored\n");
+                    periodSeconds = 0;
+                }
+                readMode = options.readMode;
+                expiryMode = options.expiryMode;
+                expiryBatch = options.expiryBatch > 0 ? options.expiryBatch : (size_t) -1;
+                expiryBudget = options.expiryBudget > 0 ? options.expiryBudget : (size_t) -1;
+                expiryCursor = 0;
+                sweepMs = options.sweepMs > 0 ? options.sweepMs : periodSeconds != 0 ? periodSeconds * 1000L : defaultSweepMs;
+                clock = options.clock != NULL ? options.clock : coarseMilliseconds;
+
+                segmentCount = 1;
+                while (segmentCount < (size_t)options.segments)
+                    segmentCount <<= 1;
+                segmentMask = segmentCount - 1;
+
+                size_t perSegment = (options.capacity + segmentCount - 1) / segmentCount;
+                timemilliseconds now = clock();
+                segments = new SegmentType[segmentCount];
+                for (size_t i = 0; i < segmentCount; i++) {
+                    segments[i].init(perSegment, options.loadFactor, readMode, options.autoShrink, options.slidingTtl);
+                    if (periodSeconds != 0)
+                        segments[i].trackDeadlines(now);
+                    segments[i].bound(limitShare(options.maxEntries, i), limitShare(options.maxBytes, i), weigher, evictedFunc != NULL);
+                }
+                lookups = !P::enabled && (options.maxEntries != 0 || options.maxBytes != 0) ? new ShardedCounter<StatHits + 1>() : NULL;
+
+                combiners = options.writeMode == WriteCombining ? new CombineQueue<K, V>[segmentCount] : NULL;
+
+                deadlines.store(periodSeconds != 0, std::memory_order_relaxed);
             }
-            
-            void  rehash(const size_t newCapacity)
+
+            // Starts the sweep of a table with a period. Constructors call it
+            // last, as the sweep takes segment locks a bulk load goes without.
+            void          startSweep()
             {
-                
-                HashNode<K, V> ** newTable = new HashNode<K, V> * [newCapacity];
-                for (int j = 0; j< capacity; j++) {
-                    HashNode<K, V> * entry = table[j];
-                    while (entry != NULL) {
-                        putEntryInternal(newTable, newCapacity, entry->getKey(), entry->getValue(), entry->getTime());
-                        delete entry;
-                        entry = entry->getNext();
+                if (periodSeconds != 0)
+                    timerId = Timer::getInstance().create(sweepMs, sweepMs, expire<K, V, F, S, P>, this);
+            }
+
+            // Runs op(segment, hash, now) under the read side of the segment: an
+            // EpochGuard in ReadLockFree and ReadOptimistic mode, the read
+            // lock otherwise.
+            template <typename Q, typename Op>
+            bool          lookup(const Q & key, Op op)
+            {
+                unsigned long hashValue = hashFormula(key);
+                SegmentType & seg = segmentFor(hashValue);
+                timemilliseconds now = readTime();
+                bool found;
+                if (lockFreeReads()) {
+                    EpochGuard guard;
+                    found = op(seg, hashValue, now);
+                } else {
+                    SegmentReadLock lock(counters, seg.mutex);
+                    found = op(seg, hashValue, now);
+                }
+                counted(found);
+                return found;
+            }
+
+            template <typename Q>
+            bool          erase(const Q & key)
+            {
+                unsigned long hashValue = hashFormula(key);
+                SegmentType & seg = segmentFor(hashValue);
+                timemilliseconds now = readTime();
+                bool removed;
+                {
+                    SegmentWriteLock lock(counters, seg.mutex);
+                    removed = seg.remove(hashValue, key, now);
+                }
+                counters.count(StatRemoves);
+                if (removed)
+                    counters.count(StatRemoved);
+                return removed;
+            }
+
+            void          counted(bool found)
+            {
+                counted(1, found ? 1 : 0);
+            }
+
+            void          counted(size_t gets, size_t hits)
+            {
+                counters.count(StatGets, gets);
+                counters.count(StatHits, hits);
+                if (lookups != NULL) {
+                    lookups->add(gets, StatGets);
+                    lookups->add(hits, StatHits);
+                }
+            }
+
+            // Share of segment i in a table-wide limit. The remainder of the
+            // split goes to the first segments, so the shares add up to the
+            // limit, but a limit below the segment count still leaves every
+            // segment 1.
+            size_t        limitShare(size_t limit, size_t i) const
+            {
+                if (limit == 0)
+                    return 0;
+                size_t share = limit / segmentCount + (i < limit % segmentCount ? 1 : 0);
+                return share > 0 ? share : 1;
+            }
+
+            // The time reads check deadlines against: 0, sparing the clock,
+            // until some entry has a deadline, and in ExpireNotify mode.
+            timemilliseconds readTime() const
+            {
+                return expiryMode == ExpireRemove && deadlines.load(std::memory_order_relaxed) ? clock() : 0;
+            }
+
+            // Timing of a write at now with the given deadline (0: none).
+            EntryTime     timing(const timemilliseconds & now, const timemilliseconds & deadline) const
+            {
+                EntryTime t;
+                t.now = expiryMode == ExpireRemove ? now : 0;
+                t.deadline = deadline;
+                long long ttl = deadline - now;
+                t.ttl = ttl <= 0 ? 0 : ttl < (long long) UINT32_MAX ? ttl : UINT32_MAX;
+                return t;
+            }
+
+            // Timing of a write with a TTL of ttlMs milliseconds, or the table
+            // period for 0; the clock is only read when it matters.
+            EntryTime     entryTime(long long ttlMs = 0)
+            {
+                if (ttlMs <= 0)
+                    ttlMs = periodSeconds * 1000LL;
+                if (ttlMs <= 0 || !SegmentType::timed)
+                    return timing(readTime(), 0);
+                startExpiry();
+                timemilliseconds now = clock();
+                return timing(now, now + ttlMs);
+            }
+
+            // Starts the expiry index of every segment and the sweep, on the
+            // first entry with a deadline; tables with a period start them
+            // in init() and startSweep().
+            void          startExpiry()
+            {
+                if (!SegmentType::timed || deadlines.load(std::memory_order_acquire))
+                    return;
+                Lock lock(&expiryMutex);
+                if (deadlines.load(std::memory_order_relaxed))
+                    return;
+                timemilliseconds now = clock();
+                for (size_t i = 0; i < segmentCount; i++) {
+                    WriteLock segmentLock(segments[i].mutex);
+                    segments[i].trackDeadlines(now);
+                }
+                timerId = Timer::getInstance().create(sweepMs, sweepMs, expire<K, V, F, S, P>, this);
+                deadlines.store(true, std::memory_order_release);
+            }
+
+            template <typename KK, typename... Args>
+            bool          store(const EntryTime & mill, bool assign, KK && key, Args &&... args)
+            {
+                unsigned long hashValue = hashFormula(key);
+                SegmentType & seg = segmentFor(hashValue);
+                bool inserted;
+                std::vector<std::pair<K, V> > gone;
+                {
+                    SegmentWriteLock lock(counters, seg.mutex);
+                    inserted = seg.emplace(hashValue, assign, mill, std::forward<KK>(key), std::forward<Args>(args)...);
+                    seg.takeEvicted(gone);
+                }
+                counters.count(StatPuts);
+                if (inserted)
+                    counters.count(StatInserts);
+                notifyEvicted(gone);
+                return inserted;
+            }
+
+            template <typename Init, typename Fn>
+            bool          update(const K & key, Init & init, Fn & fn)
+            {
+                unsigned long hashValue = hashFormula(key);
+                SegmentType & seg = segmentFor(hashValue);
+                EntryTime mill = entryTime();
+                counters.count(StatPuts);
+                bool present;
+                std::vector<std::pair<K, V> > gone;
+                {
+                    SegmentWriteLock lock(counters, seg.mutex);
+                    present = seg.compute(hashValue, key, mill, init, fn);
+                    seg.takeEvicted(gone);
+                }
+                notifyEvicted(gone);
+                return present;
+            }
+
+            // Runs fn(task) for every task in [0, tasks) on up to threads pool
+            // threads, returning when all are done.
+            template <typename Fn>
+            static void   parallel(size_t tasks, int threads, Fn & fn)
+            {
+                struct Work {
+                    Fn *                fn;
+                    size_t              tasks;
+                    std::atomic<size_t> next;
+
+                    static void run(void * para)
+                    {
+                        Work * work = (Work *) para;
+                        size_t task;
+                        while ((task = work->next.fetch_add(1, std::memory_order_relaxed)) < work->tasks)
+                            (*work->fn)(task);
                     }
+                };
+
+                Work work;
+                work.fn = &fn;
+                work.tasks = tasks;
+                work.next.store(0, std::memory_order_relaxed);
+                if (threads <= 1 || tasks <= 1) {
+                    Work::run(&work);
+                    return;
                 }
-                
-                delete [] table;
-                table = newTable;
-                capacity = newCapacity;
-                threshold =  capacity * loadFactor;
+                ThreadPool pool(threads < (int)tasks ? threads : (int)tasks);
+                for (int i = 0; i < threads && i < (int)tasks; i++)
+                    pool.submit(Work::run, &work);
             }
-            
-            bool          putEntryInternal(HashNode<K, V> ** targetTable, const size_t & size, const K & key, const V & val, const timemilliseconds & time)
+
+            // Three parallel passes over the input: hash each chunk and count
+            // its keys per segment, scatter the chunks into segment order at
+            // offsets from a prefix sum, and fill each segment on its own.
+            template <typename It>
+            void          bulkLoad(It first, It last, int threads)
             {
-                 HashNode<K, V> *prev = NULL;
-                unsigned long hashValue = hashFunc(key, size);
-                HashNode<K, V> *entry = targetTable[hashValue];
+                size_t count = last - first;
+                if (count == 0)
+                    return;
+                size_t chunks = threads > 1 ? threads * 4 : 1;
+                size_t chunkSize = (count + chunks - 1) / chunks;
+                chunks = (count + chunkSize - 1) / chunkSize;
 
-                while (entry != NULL && entry->getKey() != key) {
-                    prev = entry;
-                    entry = entry->getNext();
+                std::vector<unsigned long> hashes(count);
+                // counts[c * segmentCount + s]: keys of chunk c in segment s,
+                // then where chunk c starts writing them
+                std::vector<size_t> counts(chunks * segmentCount, 0);
+                auto hash = [&](size_t c) {
+                    size_t * mine = &counts[c * segmentCount];
+                    for (size_t i = c * chunkSize; i < count && i < (c + 1) * chunkSize; i++) {
+                        hashes[i] = hashFormula(first[i].first);
+                        mine[segmentIndex(hashes[i])] += 1;
+                    }
+                };
+                parallel(chunks, threads, hash);
+
+                std::vector<size_t> starts(segmentCount + 1, 0);
+                size_t offset = 0;
+                for (size_t seg = 0; seg < segmentCount; seg++) {
+                    starts[seg] = offset;
+                    for (size_t c = 0; c < chunks; c++) {
+                        size_t n = counts[c * segmentCount + seg];
+                        counts[c * segmentCount + seg] = offset;
+                        offset += n;
+                    }
                 }
+                starts[segmentCount] = offset;
+
+                std::vector<BatchEntry> batch(count);
+                auto scatter = [&](size_t c) {
+                    size_t * next = &counts[c * segmentCount];
+                    for (size_t i = c * chunkSize; i < count && i < (c + 1) * chunkSize; i++) {
+                        BatchEntry & e = batch[next[segmentIndex(hashes[i])]++];
+                        e.hash = hashes[i];
+                        e.index = i;
+                    }
+                };
+                parallel(chunks, threads, scatter);
 
-                if (entry == NULL) {
-                    entry = new HashNode<K, V>(key, val, time);
+                EntryTime mill = entryTime();
+                auto fill = [&](size_t seg) {
+                    SegmentType & segment = segments[seg];
+                    segment.beginBatch(starts[seg + 1] - starts[seg]);
+                    for (size_t i = starts[seg]; i < starts[seg + 1]; i++)
+                        segment.emplace(batch[i].hash, true, mill, first[batch[i].index].first, first[batch[i].index].second);
+                    segment.endBatch();
+                };
+                parallel(segmentCount, threads, fill);
+            }
+
+            // The cursor of a table scan keeps the segment in its low bits and
+            // the segment's own scan cursor above them. Entries past their
+            // deadline at now are left out; 0 visits them all.
+            template <typename Visitor>
+            unsigned long scanSegments(unsigned long cursor, Visitor & visitor, size_t count, const timemilliseconds & now)
+            {
+                size_t segment = cursor & segmentMask;
+                unsigned long inner = cursor / segmentCount;
+                {
+                    SegmentReadLock lock(counters, segments[segment].mutex);
+                    inner = segments[segment].scan(inner, visitor, count > 0 ? count : 1, now);
+                }
+                if (inner == 0 && ++segment == segmentCount)
+                    return 0;
+                return inner * segmentCount + segment;
+            }
 
-                    if (prev == NULL) {
-                        // insert as first bucket
-                        targetTable[hashValue] = entry;
+            // Publishes a put or remove and waits until some combiner, this
+            // thread or another, has applied it. A writer that keeps failing
+            // to get the lock while its slot is pending blocks on it instead,
+            // so readers holding the lock cannot starve it.
+            bool          combine(CombineOp op, const K & key, const V * value)
+            {
+                unsigned long hashValue = hashFormula(key);
+                size_t index = segmentIndex(hashValue);
+                SegmentType & seg = segments[index];
+                CombineQueue<K, V> & queue = combiners[index];
+                typename CombineQueue<K, V>::Slot * slot = queue.publish(op, hashValue, &key, value);
 
+                for (int spins = 0; slot->state.load(std::memory_order_acquire) != CombineSlot<K, V>::Done; spins++) {
+                    std::vector<std::pair<K, V> > gone;
+                    if (spins < combineSpins) {
+                        TryWriteLock lock(seg.mutex);
+                        if (!lock.acquired()) {
+                            // the lock holder is probably combining this slot
+                            // already; watch it before trying the lock again
+                            for (int i = 0; i < 64 && slot->state.load(std::memory_order_acquire) != CombineSlot<K, V>::Done; i++)
+                                ;
+                            if (spins % 16 == 15)
+                                sched_yield();
+                            continue;
+                        }
+                        applyCombined(seg, queue, gone);
                     } else {
-                        prev->setNext(entry);
+                        SegmentWriteLock lock(counters, seg.mutex);
+                        applyCombined(seg, queue, gone);
                     }
+                    notifyEvicted(gone);
+                }
+
+                bool result = queue.release(slot);
+                if (op == CombinePut) {
+                    counters.count(StatPuts);
+                    if (result)
+                        counters.count(StatInserts);
                 } else {
-                    // just update the value
-                    entry->setValue(val);
-                    entry->setTime(time);
-                    return true;
-                } 
-                return false;
+                    counters.count(StatRemoves);
+                    if (result)
+                        counters.count(StatRemoved);
+                }
+                return result;
             }
-            
-            unsigned long hashFunc(const K & key, const size_t & size)
+
+            // The combiner pass, under the segment write lock: applies every
+            // pending slot, a few times over while new ones keep coming, with
+            // one clock reading and one resize check for the lot.
+            void          applyCombined(SegmentType & seg, CombineQueue<K, V> & queue, std::vector<std::pair<K, V> > & gone)
+            {
+                typedef CombineSlot<K, V> Slot;
+                EntryTime mill = entryTime();
+                seg.beginBatch(0);
+                for (int pass = 0; pass < combinePasses; pass++) {
+                    size_t applied = 0;
+                    for (size_t i = 0; i < combineSlots; i++) {
+                        Slot & slot = queue[i];
+                        if (slot.state.load(std::memory_order_acquire) != Slot::Pending)
+                            continue;
+                        if (slot.op == CombinePut)
+                            slot.result = seg.emplace(slot.hash, true, mill, *slot.key, *slot.value);
+                        else
+                            slot.result = seg.remove(slot.hash, *slot.key, mill.now);
+                        slot.state.store(Slot::Done, std::memory_order_release);
+                        applied += 1;
+                    }
+                    if (applied == 0)
+                        break;
+                }
+                seg.endBatch();
+                seg.takeEvicted(gone);
+            }
+
+            // one snapshot record, decoded and hashed, waiting for its segment
+            struct LoadedEntry {
+                unsigned long   hash;
+                K               key;
+                V               value;
+                // ms to the deadline, 0 for none
+                long long       remaining;
+            };
+
+            // Checks the header of a mapped snapshot and decodes its records
+            // into one list per segment.
+            bool          decode(const char * data, size_t length, std::vector<std::vector<LoadedEntry> > & bySegment)
             {
-                 unsigned long hashVal = hashFormula(key);
-                return hashVal % size;
+                SnapshotHeader header;
+                memcpy(&header, data, sizeof(header));
+                if (memcmp(header.magic, snapshotMagic, sizeof(header.magic)) != 0 || header.version != snapshotVersion
+                    || header.headerSize != sizeof(SnapshotHeader) || header.keySize != sizeof(K) || header.valueSize != sizeof(V))
+                    return false;
+                // every record holds at least its remaining time, so a count
+                // beyond that is corrupt and must not size the lists below
+                if (header.count > (length - sizeof(header)) / sizeof(long long))
+                    return false;
+
+                bySegment.resize(segmentCount);
+                for (size_t i = 0; i < segmentCount; i++)
+                    bySegment[i].reserve(header.count / segmentCount + header.count / segmentCount / 8 + 1);
+
+                const char * pos = data + sizeof(header);
+                const char * end = data + length;
+                LoadedEntry e;
+                for (uint64_t n = 0; n < header.count; n++) {
+                    if (!Serializer<K>::read(pos, end, e.key) || !Serializer<V>::read(pos, end, e.value)
+                        || !Serializer<long long>::read(pos, end, e.remaining) || e.remaining < 0)
+                        return false;
+                    e.hash = hashFormula(e.key);
+                    bySegment[segmentIndex(e.hash)].push_back(std::move(e));
+                }
+                return pos == end;
+            }
+
+            // One sweep over the segments, from where the last one stopped. Each
+            // segment is worked through in lock holds of expiryBatch due
+            // records, with the expired entries handed out between holds,
+            // until the segment is done or the budget is spent. Returns the
+            // number of entries expired.
+            size_t        sweepExpired(const timemilliseconds & now)
+            {
+                std::vector<K> keys;
+                std::vector<std::pair<K, V> > removed;
+                size_t budget = expiryBudget;
+                size_t count = 0;
+                for (size_t n = 0; n < segmentCount; n++) {
+                    SegmentType & seg = segments[expiryCursor];
+                    size_t limit;
+                    size_t fired;
+                    do {
+                        limit = budget < expiryBatch ? budget : expiryBatch;
+                        {
+                            WriteLock lock(seg.mutex);
+                            if (expiryMode == ExpireRemove)
+                                fired = seg.removeExpired(now, limit, removed);
+                            else
+                                fired = seg.collectExpired(now, limit, keys);
+                        }
+                        budget -= fired;
+                        count += keys.size() + removed.size();
+                        deliverExpired(keys, removed);
+                    } while (fired == limit && budget > 0);
+                    if (budget == 0)
+                        break;
+                    expiryCursor = (expiryCursor + 1) & segmentMask;
+                }
+                return count;
+            }
+
+            void          deliverExpired(std::vector<K> & keys, std::vector<std::pair<K, V> > & removed)
+            {
+                if (!removed.empty()) {
+                    if (expiredBatchFunc != NULL) {
+                        expiredBatchFunc(removed);
+                    } else if (expiredFunc != NULL) {
+                        for (size_t i = 0; i < removed.size(); i++)
+                            expiredFunc(removed[i].first);
+                    }
+                    removed.clear();
+                }
+                if (expiredFunc != NULL) {
+                    for (size_t i = 0; i < keys.size(); i++)
+                        expiredFunc(keys[i]);
+                }
+                keys.clear();
+            }
+
+            // Evicted entries are handed out once the segment lock is gone,
+            // so the callback may use the table.
+            void          notifyEvicted(std::vector<std::pair<K, V> > & gone)
+            {
+                for (size_t i = 0; i < gone.size(); i++)
+                    evictedFunc(gone[i].first, gone[i].second);
+            }
+
+            // Hashes a batch and orders it by segment with a stable counting
+            // sort: the keys of segment i end up in batch[starts[i]] up to
+            // batch[starts[i + 1]], in their original order.
+            void          plan(const K * keys, size_t count, std::vector<BatchEntry> & batch, std::vector<size_t> & starts)
+            {
+                std::vector<BatchEntry> hashed(count);
+                starts.assign(segmentCount + 1, 0);
+                for (size_t i = 0; i < count; i++) {
+                    hashed[i].hash = hashFormula(keys[i]);
+                    hashed[i].index = i;
+                    starts[segmentIndex(hashed[i].hash) + 1] += 1;
+                }
+                for (size_t i = 0; i < segmentCount; i++)
+                    starts[i + 1] += starts[i];
+
+                batch.resize(count);
+                std::vector<size_t> next(starts.begin(), starts.end() - 1);
+                for (size_t i = 0; i < count; i++)
+                    batch[next[segmentIndex(hashed[i].hash)]++] = hashed[i];
+            }
+
+            // Runs fn over the keys of one segment, prefetching the buckets
+            // two distances ahead and their first entries one distance ahead.
+            template <typename Fn>
+            static void   runBatch(SegmentType & seg, const BatchEntry * batch, size_t n, Fn & fn)
+            {
+                const size_t d = batchPrefetchDistance;
+                for (size_t i = 0; i < n && i < 2 * d; i++)
+                    seg.prefetchBucket(batch[i].hash);
+                for (size_t i = 0; i < n && i < d; i++)
+                    seg.prefetchEntry(batch[i].hash);
+                for (size_t i = 0; i < n; i++) {
+                    if (i + 2 * d < n)
+                        seg.prefetchBucket(batch[i + 2 * d].hash);
+                    if (i + d < n)
+                        seg.prefetchEntry(batch[i + d].hash);
+                    fn(seg, batch[i]);
+                }
+            }
+
+            // Reads that only need an EpochGuard: lock-free chains, or seqlock
+            // reads of a flat segment, when the backend supports the mode.
+            bool          lockFreeReads() const
+            {
+                return (SegmentType::lockFreeReads && readMode == ReadLockFree)
+                       || (SegmentType::optimisticReads && readMode == ReadOptimistic);
+            }
+
+            // Picks the segment from the high bits of a Fibonacci-mixed hash,
+            // so the segment choice does not correlate with the bucket index
+            // taken from the low bits inside the segment.
+            size_t        segmentIndex(unsigned long hashValue) const
+            {
+                unsigned long mixed = hashValue * 0x9E3779B97F4A7C15UL;
+                return (mixed >> 40) & segmentMask;
+            }
+
+            SegmentType & segmentFor(unsigned long hashValue)
+            {
+                return segments[segmentIndex(hashValue)];
             }
            
     };
     
-    template <typename K, typename V, typename F>
+    template <typename K, typename V, typename F, typename S, typename P>
     void expire(void * para) {
-        Hashtable<K, V, F> * table = (Hashtable<K, V, F> * )para;
-        ExpiredIterator<K, V, F> itr = table->expiredKeys();
-        while (itr.hasNext()) {
-            if (table ->expiredFunc != NULL) {
-                K  key;
-                V  val;
-                itr.next(key, val);
-                table->expiredFunc(key);
-                
-            }
-        }
+        Hashtable<K, V, F, S, P> * table = (Hashtable<K, V, F, S, P> * )para;
+        timemilliseconds now = table->clock();
+        long long begin = P::enabled ? monotonicNanoseconds() : 0;
+        // only the records the timing wheel has due are looked at
+        size_t expired = table->sweepExpired(now);
+        if (P::enabled)
+            table->counters.sweep(monotonicNanoseconds() - begin, expired);
     }
 }
 #endif // HASHTABLE_H
@@ -0,0 +1,56 @@
+
+#include "HashtableStats.h"
+
+#include <sstream>
+
+dt::HashtableStats::HashtableStats() :
+    gets(0), hits(0), misses(0), puts(0), inserts(0), removes(0), removed(0),
+    readLockWaits(0), readLockWaitNs(0), writeLockWaits(0), writeLockWaitNs(0),
+    resizes(0), moved(0), resizeNs(0), maxResizeNs(0),
+    sweeps(0), expired(0), sweepNs(0), maxSweepNs(0), evictions(0),
+    entries(0), buckets(0), usedBuckets(0), maxChain(0), chainLengths(statsChainBuckets + 1, 0)
+{
+}
+
+std::string dt::HashtableStats::toText() const
+{
+    std::ostringstream out;
+    out << "entries " << entries << " buckets " << buckets << " used " << usedBuckets
+        << " max chain " << maxChain << "\n";
+    out << "chains";
+    for (size_t i = 0; i < chainLengths.size(); i++)
+        out << " " << i << (i + 1 == chainLengths.size() ? "+:" : ":") << chainLengths[i];
+    out << "\n";
+    out << "gets " << gets << " hits " << hits << " misses " << misses
+        << " puts " << puts << " inserts " << inserts
+        << " removes " << removes << " removed " << removed << "\n";
+    out << "read lock waits " << readLockWaits << " (" << readLockWaitNs << " ns)"
+        << " write lock waits " << writeLockWaits << " (" << writeLockWaitNs << " ns)\n";
+    out << "resizes " << resizes << " moved " << moved << " resize ns " << resizeNs
+        << " max " << maxResizeNs << "\n";
+    out << "sweeps " << sweeps << " expired " << expired << " sweep ns " << sweepNs
+        << " max " << maxSweepNs << "\n";
+    out << "evictions " << evictions << "\n";
+    return out.str();
+}
+
+std::string dt::HashtableStats::toJson() const
+{
+    std::ostringstream out;
+    out << "{\"entries\":" << entries << ",\"buckets\":" << buckets
+        << ",\"used_buckets\":" << usedBuckets << ",\"max_chain\":" << maxChain
+        << ",\"chain_lengths\":[";
+    for (size_t i = 0; i < chainLengths.size(); i++)
+        out << (i > 0 ? "," : "") << chainLengths[i];
+    out << "],\"gets\":" << gets << ",\"hits\":" << hits << ",\"misses\":" << misses
+        << ",\"puts\":" << puts << ",\"inserts\":" << inserts
+        << ",\"removes\":" << removes << ",\"removed\":" << removed
+        << ",\"read_lock_waits\":" << readLockWaits << ",\"read_lock_wait_ns\":" << readLockWaitNs
+        << ",\"write_lock_waits\":" << writeLockWaits << ",\"write_lock_wait_ns\":" << writeLockWaitNs
+        << ",\"resizes\":" << resizes << ",\"moved\":" << moved
+        << ",\"resize_ns\":" << resizeNs << ",\"max_resize_ns\":" << maxResizeNs
+        << ",\"sweeps\":" << sweeps << ",\"expired\":" << expired
+        << ",\"sweep_ns\":" << sweepNs << ",\"max_sweep_ns\":" << maxSweepNs
+        << ",\"evictions\":" << evictions << "}";
+    return out.str();
+}
@@ -0,0 +1,194 @@
+#ifndef HASHTABLESTATS_H
+#define HASHTABLESTATS_H
+
+#include <cstddef>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "Common.h"
+#include "Threads.h"
+#include "ShardedCounter.h"
+
+namespace dt {
+
+    // Resize history of one segment, kept by the segment itself under its
+    // write lock. It costs two clock reads per resize, so it is always on.
+    struct ResizeStats {
+        size_t              resizes;        // resizes completed
+        size_t              moved;          // buckets (or flat slots) moved by them
+        unsigned long long  resizeNs;       // time from start to end of each resize
+        unsigned long long  maxResizeNs;
+
+        ResizeStats() : resizes(0), moved(0), resizeNs(0), maxResizeNs(0) {}
+
+        void finished(unsigned long long ns)
+        {
+            resizes += 1;
+            resizeNs += ns;
+            if (ns > maxResizeNs)
+                maxResizeNs = ns;
+        }
+    };
+
+    // longest chain length counted on its own by Hashtable::stats(); longer
+    // chains fall into the last slot of the histogram
+    const size_t statsChainBuckets = 16;
+
+    // Snapshot returned by Hashtable::stats(). Operation counters, lock
+    // waits and expiry sweeps are only counted under the CollectStats
+    // policy and read 0 otherwise, except that a bounded table always
+    // counts gets, hits and misses; sizes, chains, resizes and evictions
+    // are always filled in.
+    struct HashtableStats {
+        // lookups of any kind: get, visit, contain and multiGet keys
+        unsigned long       gets;
+        unsigned long       hits;
+        unsigned long       misses;
+        // writes of any kind, and the ones of them that added a new key
+        // (compute and merge do not tell)
+        unsigned long       puts;
+        unsigned long       inserts;
+        // remove calls, and the ones of them that found their key
+        unsigned long       removes;
+        unsigned long       removed;
+
+        // locks that were not free at the first try, and the time spent waiting for them
+        unsigned long       readLockWaits;
+        unsigned long long  readLockWaitNs;
+        unsigned long       writeLockWaits;
+        unsigned long long  writeLockWaitNs;
+
+        size_t              resizes;
+        size_t              moved;
+        unsigned long long  resizeNs;
+        unsigned long long  maxResizeNs;
+
+        unsigned long       sweeps;
+        unsigned long       expired;
+        unsigned long long  sweepNs;
+        unsigned long long  maxSweepNs;
+
+        // entries dropped by a bounded table to stay within its limits
+        size_t              evictions;
+
+        size_t              entries;
+        size_t              buckets;
+        size_t              usedBuckets;
+        size_t              maxChain;
+        // chainLengths[n]: buckets holding n entries
+        std::vector<size_t> chainLengths;
+
+        HashtableStats();
+
+        std::string toText() const;
+        // a single JSON object, for scraping
+        std::string toJson() const;
+    };
+
+    // Counters of the CollectStats policy.
+    enum StatCounter {
+        StatGets,
+        StatHits,
+        StatPuts,
+        StatInserts,
+        StatRemoves,
+        StatRemoved,
+        StatReadWaits,
+        StatReadWaitNs,
+        StatWriteWaits,
+        StatWriteWaitNs,
+        StatCounterCount
+    };
+
+    // Stats policy that counts nothing; every call compiles away.
+    struct NoStats {
+        static const bool enabled = false;
+
+        void count(StatCounter, unsigned long = 1) {}
+        void lockWaited(bool, long long) {}
+        void sweep(unsigned long long, size_t) {}
+        void fill(HashtableStats &) const {}
+    };
+
+    // Stats policy that counts every operation. The counters are sharded
+    // per thread (ShardedCounter.h), so counting threads do not share a
+    // cache line while there are no more of them than hardware threads;
+    // the shards are only summed when stats() asks for them.
+    class CollectStats : noncopyable {
+        public :
+            static const bool enabled = true;
+
+            CollectStats() : sweeps(0), expired(0), sweepNs(0), maxSweepNs(0)
+            {
+            }
+
+            void count(StatCounter counter, unsigned long n = 1)
+            {
+                counters.add(n, counter);
+            }
+
+            void lockWaited(bool write, long long ns)
+            {
+                if (ns <= 0)
+                    return;
+                counters.add(1, write ? StatWriteWaits : StatReadWaits);
+                counters.add(ns, write ? StatWriteWaitNs : StatReadWaitNs);
+            }
+
+            // only called from the expiry sweep
+            void sweep(unsigned long long ns, size_t found)
+            {
+                sweeps.fetch_add(1, std::memory_order_relaxed);
+                expired.fetch_add(found, std::memory_order_relaxed);
+                sweepNs.fetch_add(ns, std::memory_order_relaxed);
+                if (ns > maxSweepNs.load(std::memory_order_relaxed))
+                    maxSweepNs.store(ns, std::memory_order_relaxed);
+            }
+
+            void fill(HashtableStats & s) const
+            {
+                long totals[StatCounterCount];
+                counters.approximate(totals);
+
+                s.gets = totals[StatGets];
+                s.hits = totals[StatHits];
+                s.misses = s.gets - s.hits;
+                s.puts = totals[StatPuts];
+                s.inserts = totals[StatInserts];
+                s.removes = totals[StatRemoves];
+                s.removed = totals[StatRemoved];
+                s.readLockWaits = totals[StatReadWaits];
+                s.readLockWaitNs = totals[StatReadWaitNs];
+                s.writeLockWaits = totals[StatWriteWaits];
+                s.writeLockWaitNs = totals[StatWriteWaitNs];
+                s.sweeps = sweeps.load(std::memory_order_relaxed);
+                s.expired = expired.load(std::memory_order_relaxed);
+                s.sweepNs = sweepNs.load(std::memory_order_relaxed);
+                s.maxSweepNs = maxSweepNs.load(std::memory_order_relaxed);
+            }
+
+        private :
+            ShardedCounter<StatCounterCount>    counters;
+            std::atomic<unsigned long>          sweeps;
+            std::atomic<unsigned long>          expired;
+            std::atomic<unsigned long long>     sweepNs;
+            std::atomic<unsigned long long>     maxSweepNs;
+    };
+
+    // A segment lock that reports to the stats policy P how long it had to
+    // wait; L is ReadLock or WriteLock. Under NoStats it is the plain lock.
+    template <typename P, typename L, bool Write>
+    class StatsLock : noncopyable {
+        public :
+            StatsLock(P & stats, ReadWriteMutex * m) : waited(0), lock(m, P::enabled ? &waited : NULL)
+            {
+                stats.lockWaited(Write, waited);
+            }
+
+        private :
+            long long   waited;
+            L           lock;
+    };
+}
+#endif // HASHTABLESTATS_H
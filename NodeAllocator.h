@@ -0,0 +1,277 @@
+#ifndef NODEALLOCATOR_H
+#define NODEALLOCATOR_H
+
+#include <cstddef>
+#include <new>
+#include <vector>
+#include <atomic>
+#include <stdio.h>
+#include <sys/mman.h>
+
+#include "Common.h"
+#include "Threads.h"
+
+namespace dt {
+
+    // Slab usage of one node allocator, as reported by Hashtable::allocatorStats().
+    struct SlabStats {
+        size_t  blockSize;      // bytes handed out per node
+        size_t  slabs;          // slabs mapped so far
+        size_t  slabBytes;      // bytes mapped for them
+        size_t  hugePageSlabs;  // slabs backed by explicit huge pages
+        size_t  blocksInUse;    // nodes currently allocated
+        size_t  blocksFree;     // carved nodes waiting in free lists
+
+        SlabStats() : blockSize(0), slabs(0), slabBytes(0), hugePageSlabs(0), blocksInUse(0), blocksFree(0) {}
+    };
+
+    // Node allocator of the plain new / delete kind (the default).
+    struct NewAllocator {
+        template <typename T>
+        static void * allocate()
+        {
+            return ::operator new(sizeof(T));
+        }
+
+        template <typename T>
+        static void deallocate(void * p)
+        {
+            ::operator delete(p);
+        }
+
+        template <typename T>
+        static SlabStats stats()
+        {
+            SlabStats s;
+            s.blockSize = sizeof(T);
+            return s;
+        }
+    };
+
+    const size_t slabSize = 2 * 1024 * 1024;
+    // blocks moved between a thread cache and the shared pool at once
+    const size_t slabBatch = 256;
+
+    // Fixed-size block pool shared by every node type of the same size and
+    // alignment. Each thread allocates from and frees into its own cache;
+    // only an empty or overfull cache touches the shared pool, one batch at a
+    // time, and only an empty shared pool maps a new slab. Slabs come
+    // straight from mmap and are never handed back, so the global heap is
+    // not involved at all.
+    template <size_t Size, size_t Align>
+    class SlabPool : noncopyable {
+        public :
+            // free blocks are linked through their first word
+            struct FreeBlock {
+                FreeBlock * next;
+            };
+
+            static const size_t blockSize = ((Size < sizeof(FreeBlock) ? sizeof(FreeBlock) : Size) + Align - 1) / Align * Align;
+
+            struct ThreadCache {
+                FreeBlock *     head;
+                // only written by the owning thread; atomic so stats() can read it
+                std::atomic<size_t> count;
+                bool            registered;
+
+                ThreadCache() : head(NULL), count(0), registered(false) {}
+
+                ~ThreadCache()
+                {
+                    if (registered)
+                        SlabPool::getInstance().release(*this);
+                }
+            };
+
+            static SlabPool & getInstance()
+            {
+                static SlabPool INSTANCE;
+                return INSTANCE;
+            }
+
+            void * allocate(bool hugePages)
+            {
+                ThreadCache & c = cache;
+                if (c.head == NULL)
+                    refill(c, hugePages);
+                FreeBlock * b = c.head;
+                c.head = b->next;
+                c.count.store(c.count.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+                return b;
+            }
+
+            void deallocate(void * p)
+            {
+                ThreadCache & c = cache;
+                if (!c.registered) {
+                    // a thread that only ever frees must still hand its cache back on exit
+                    Lock lock(&mutex);
+                    registerCache(c);
+                }
+                FreeBlock * b = static_cast<FreeBlock *>(p);
+                b->next = c.head;
+                c.head = b;
+                size_t count = c.count.load(std::memory_order_relaxed) + 1;
+                c.count.store(count, std::memory_order_relaxed);
+                if (count >= 2 * slabBatch)
+                    spill(c);
+            }
+
+            SlabStats stats()
+            {
+                Lock lock(&mutex);
+                SlabStats s;
+                s.blockSize = blockSize;
+                s.slabs = slabCount;
+                s.slabBytes = slabCount * slabSize;
+                s.hugePageSlabs = hugeSlabCount;
+                size_t free = sharedCount;
+                for (size_t i = 0; i < caches.size(); i++)
+                    free += caches[i]->count;
+                s.blocksFree = free;
+                s.blocksInUse = carved - free;
+                return s;
+            }
+
+        private :
+            Mutex                       mutex;
+            FreeBlock *                 shared;
+            size_t                      sharedCount;
+            // blocks left in the slab being carved
+            char *                      bump;
+            char *                      bumpEnd;
+            size_t                      carved;
+            size_t                      slabCount;
+            size_t                      hugeSlabCount;
+            std::vector<ThreadCache *>  caches;
+
+            static thread_local ThreadCache cache;
+
+            SlabPool() : shared(NULL), sharedCount(0), bump(NULL), bumpEnd(NULL), carved(0), slabCount(0), hugeSlabCount(0) {}
+
+            // called with mutex held, the first time a thread needs the pool
+            void registerCache(ThreadCache & c)
+            {
+                if (!c.registered) {
+                    caches.push_back(&c);
+                    c.registered = true;
+                }
+            }
+
+            void refill(ThreadCache & c, bool hugePages)
+            {
+                Lock lock(&mutex);
+                registerCache(c);
+                for (size_t n = 0; n < slabBatch; n++) {
+                    FreeBlock * b;
+                    if (shared != NULL) {
+                        b = shared;
+                        shared = b->next;
+                        sharedCount -= 1;
+                    } else {
+                        if (bump + blockSize > bumpEnd && !mapSlab(hugePages)) {
+                            if (n == 0)
+                                throw std::bad_alloc();
+                            break;
+                        }
+                        b = reinterpret_cast<FreeBlock *>(bump);
+                        bump += blockSize;
+                        carved += 1;
+                    }
+                    b->next = c.head;
+                    c.head = b;
+                    c.count.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+
+            void spill(ThreadCache & c)
+            {
+                Lock lock(&mutex);
+                for (size_t n = 0; n < slabBatch && c.head != NULL; n++) {
+                    FreeBlock * b = c.head;
+                    c.head = b->next;
+                    c.count.fetch_sub(1, std::memory_order_relaxed);
+                    b->next = shared;
+                    shared = b;
+                    sharedCount += 1;
+                }
+            }
+
+            void release(ThreadCache & c)
+            {
+                Lock lock(&mutex);
+                while (c.head != NULL) {
+                    FreeBlock * b = c.head;
+                    c.head = b->next;
+                    b->next = shared;
+                    shared = b;
+                    sharedCount += 1;
+                }
+                c.count.store(0, std::memory_order_relaxed);
+                for (size_t i = 0; i < caches.size(); i++) {
+                    if (caches[i] == &c) {
+                        caches.erase(caches.begin() + i);
+                        break;
+                    }
+                }
+            }
+
+            bool mapSlab(bool hugePages)
+            {
+                void * p = MAP_FAILED;
+                bool huge = false;
+#ifdef MAP_HUGETLB
+                if (hugePages) {
+                    p = mmap(NULL, slabSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                    huge = p != MAP_FAILED;
+                }
+#endif
+                if (p == MAP_FAILED) {
+                    p = mmap(NULL, slabSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                    if (p == MAP_FAILED) {
+                        perror("slab mmap");
+                        return false;
+                    }
+#ifdef MADV_HUGEPAGE
+                    // no reserved huge pages: ask for transparent ones instead
+                    if (hugePages)
+                        madvise(p, slabSize, MADV_HUGEPAGE);
+#endif
+                }
+                bump = static_cast<char *>(p);
+                bumpEnd = bump + slabSize;
+                slabCount += 1;
+                if (huge)
+                    hugeSlabCount += 1;
+                return true;
+            }
+    };
+
+    template <size_t Size, size_t Align>
+    thread_local typename SlabPool<Size, Align>::ThreadCache SlabPool<Size, Align>::cache;
+
+    // Node allocator backed by per-thread free lists over 2MB slabs. With
+    // HugePages the slabs are mapped with MAP_HUGETLB, falling back to
+    // transparent huge pages when none are reserved.
+    template <bool HugePages = false>
+    struct SlabAllocator {
+        template <typename T>
+        static void * allocate()
+        {
+            return SlabPool<sizeof(T), alignof(T)>::getInstance().allocate(HugePages);
+        }
+
+        template <typename T>
+        static void deallocate(void * p)
+        {
+            SlabPool<sizeof(T), alignof(T)>::getInstance().deallocate(p);
+        }
+
+        template <typename T>
+        static SlabStats stats()
+        {
+            return SlabPool<sizeof(T), alignof(T)>::getInstance().stats();
+        }
+    };
+}
+#endif // NODEALLOCATOR_H
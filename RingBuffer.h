@@ -0,0 +1,405 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <cstddef>
+#include <atomic>
+#include <new>
+#include <utility>
+#include <sched.h>
+
+#include "Common.h"
+#include "Threads.h"
+
+namespace dt {
+
+    // Keeps the fields on either side on different cache line pairs, as the
+    // adjacent line prefetcher pulls lines in pairs.
+    const size_t ringPadding = 128;
+
+    // tries of a blocking push / pop before it goes to sleep
+    const int ringSpins = 256;
+
+    // Sleeping side of the blocking calls. A waiter announces itself before
+    // retrying the ring, and the other side only takes the mutex when
+    // somebody is announced, so the lock-free path pays one atomic add.
+    // The signal count closes the gap between a failed retry and the wait:
+    // a waiter only sleeps if nothing was signalled since before it retried.
+    // Rings built without blocking skip all this, and their blocking calls
+    // spin and yield instead of sleeping.
+    class RingWaiters : noncopyable {
+        public :
+            explicit RingWaiters(bool on) : enabled(on), waiting(0), signals(0) {}
+
+            template <typename Ready>
+            void wait(Ready ready)
+            {
+                for (int i = 0; i < ringSpins || !enabled; i++) {
+                    if (ready())
+                        return;
+                    sched_yield();
+                }
+                waiting.fetch_add(1, std::memory_order_seq_cst);
+                while (true) {
+                    unsigned long seen = signals.load(std::memory_order_acquire);
+                    if (ready())
+                        break;
+                    Lock lock(&mutex);
+                    if (signals.load(std::memory_order_relaxed) == seen)
+                        changed.waitUntil(&mutex, monotonicMilliseconds() + 100);
+                }
+                waiting.fetch_sub(1, std::memory_order_relaxed);
+            }
+
+            void notify()
+            {
+                if (!enabled)
+                    return;
+                // an RMW, not a load: reading the count through the same
+                // modification order as the waiter's increment is what
+                // orders the caller's store before the check
+                if (waiting.fetch_add(0, std::memory_order_seq_cst) != 0) {
+                    Lock lock(&mutex);
+                    signals.fetch_add(1, std::memory_order_release);
+                    changed.broadcast();
+                }
+            }
+
+        private :
+            const bool          enabled;
+            std::atomic<int>    waiting;
+            std::atomic<unsigned long> signals;
+            Mutex               mutex;
+            Condition           changed;
+    };
+
+    // Bounded single-producer single-consumer queue. Every call is
+    // wait-free: each side owns one index and keeps a private copy of the
+    // other one, refreshed only when the ring looks full (or empty), so a
+    // push or pop normally touches no shared cache line but the slot.
+    // The capacity is rounded up to a power of two; blocking enables
+    // sleeping in push() and pop().
+    template <typename T>
+    class SpscRing : noncopyable {
+        public :
+            explicit SpscRing(size_t size, bool blocking = false) : capacity(roundUp(size)), mask(capacity - 1),
+                slots(static_cast<T *>(::operator new(capacity * sizeof(T)))), tail(0), headCache(0), head(0), tailCache(0), waiters(blocking)
+            {
+            }
+
+            ~SpscRing()
+            {
+                T item;
+                while (tryPop(item))
+                    ;
+                ::operator delete(slots);
+            }
+
+            template <typename U>
+            bool tryPush(U && item)
+            {
+                size_t t = tail.load(std::memory_order_relaxed);
+                if (t - headCache == capacity) {
+                    headCache = head.load(std::memory_order_acquire);
+                    if (t - headCache == capacity)
+                        return false;
+                }
+                new (&slots[t & mask]) T(std::forward<U>(item));
+                tail.store(t + 1, std::memory_order_release);
+                waiters.notify();
+                return true;
+            }
+
+            bool tryPop(T & item)
+            {
+                size_t h = head.load(std::memory_order_relaxed);
+                if (h == tailCache) {
+                    tailCache = tail.load(std::memory_order_acquire);
+                    if (h == tailCache)
+                        return false;
+                }
+                T & slot = slots[h & mask];
+                item = std::move(slot);
+                slot.~T();
+                head.store(h + 1, std::memory_order_release);
+                waiters.notify();
+                return true;
+            }
+
+            // Pushes as many of the count items as fit, publishing them with
+            // one index store; returns how many went in.
+            size_t pushBatch(const T * items, size_t count)
+            {
+                size_t t = tail.load(std::memory_order_relaxed);
+                if (capacity - (t - headCache) < count)
+                    headCache = head.load(std::memory_order_acquire);
+                size_t n = capacity - (t - headCache);
+                if (n > count)
+                    n = count;
+                for (size_t i = 0; i < n; i++)
+                    new (&slots[(t + i) & mask]) T(items[i]);
+                if (n > 0) {
+                    tail.store(t + n, std::memory_order_release);
+                    waiters.notify();
+                }
+                return n;
+            }
+
+            // Pops up to count items into items; returns how many came out.
+            size_t popBatch(T * items, size_t count)
+            {
+                size_t h = head.load(std::memory_order_relaxed);
+                if (tailCache - h < count)
+                    tailCache = tail.load(std::memory_order_acquire);
+                size_t n = tailCache - h;
+                if (n > count)
+                    n = count;
+                for (size_t i = 0; i < n; i++) {
+                    T & slot = slots[(h + i) & mask];
+                    items[i] = std::move(slot);
+                    slot.~T();
+                }
+                if (n > 0) {
+                    head.store(h + n, std::memory_order_release);
+                    waiters.notify();
+                }
+                return n;
+            }
+
+            // Blocking variants: spin a little, then sleep until the other
+            // side makes room (or an item) when the ring was built blocking.
+            template <typename U>
+            void push(U && item)
+            {
+                waiters.wait([&]() { return tryPush(std::forward<U>(item)); });
+            }
+
+            void pop(T & item)
+            {
+                waiters.wait([&]() { return tryPop(item); });
+            }
+
+            // exact on either side, a snapshot elsewhere
+            size_t size() const
+            {
+                return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+            }
+
+            size_t getCapacity() const
+            {
+                return capacity;
+            }
+
+        private :
+            const size_t        capacity;
+            const size_t        mask;
+            T * const           slots;
+            char                padding0[ringPadding];
+            // producer side
+            std::atomic<size_t> tail;
+            size_t              headCache;
+            char                padding1[ringPadding - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+            // consumer side
+            std::atomic<size_t> head;
+            size_t              tailCache;
+            char                padding2[ringPadding - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+            RingWaiters         waiters;
+
+            static size_t roundUp(size_t size)
+            {
+                size_t c = 2;
+                while (c < size)
+                    c <<= 1;
+                return c;
+            }
+    };
+
+    // Bounded multi-producer multi-consumer queue after Dmitry Vyukov: each
+    // cell carries a sequence number telling whether it is free for the
+    // producer of a given lap or full for its consumer, so producers and
+    // consumers only contend on their own index, with one CAS per call
+    // (or per batch). Lock-free; the capacity is rounded up to a power of two.
+    template <typename T>
+    class MpmcRing : noncopyable {
+        public :
+            explicit MpmcRing(size_t size, bool blocking = false) : capacity(roundUp(size)), mask(capacity - 1),
+                cells(static_cast<Cell *>(::operator new(capacity * sizeof(Cell)))), tail(0), head(0), waiters(blocking)
+            {
+                for (size_t i = 0; i < capacity; i++)
+                    new (&cells[i].sequence) std::atomic<size_t>(i);
+            }
+
+            ~MpmcRing()
+            {
+                T item;
+                while (tryPop(item))
+                    ;
+                ::operator delete(cells);
+            }
+
+            template <typename U>
+            bool tryPush(U && item)
+            {
+                size_t pos = tail.load(std::memory_order_relaxed);
+                Cell * cell;
+                while (true) {
+                    cell = &cells[pos & mask];
+                    size_t seq = cell->sequence.load(std::memory_order_acquire);
+                    long diff = (long)(seq - pos);
+                    if (diff == 0) {
+                        if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                            break;
+                    } else if (diff < 0) {
+                        return false;
+                    } else {
+                        pos = tail.load(std::memory_order_relaxed);
+                    }
+                }
+                new (cell->item()) T(std::forward<U>(item));
+                cell->sequence.store(pos + 1, std::memory_order_release);
+                waiters.notify();
+                return true;
+            }
+
+            bool tryPop(T & item)
+            {
+                size_t pos = head.load(std::memory_order_relaxed);
+                Cell * cell;
+                while (true) {
+                    cell = &cells[pos & mask];
+                    size_t seq = cell->sequence.load(std::memory_order_acquire);
+                    long diff = (long)(seq - (pos + 1));
+                    if (diff == 0) {
+                        if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                            break;
+                    } else if (diff < 0) {
+                        return false;
+                    } else {
+                        pos = head.load(std::memory_order_relaxed);
+                    }
+                }
+                take(cell, pos, item);
+                waiters.notify();
+                return true;
+            }
+
+            // Claims up to count consecutive free cells with a single CAS and
+            // fills them; returns how many items went in. A cell is only
+            // claimable once its own sequence says so, and nobody else can
+            // claim it without moving tail past pos first, so checking the
+            // cells before the CAS is enough.
+            size_t pushBatch(const T * items, size_t count)
+            {
+                size_t pos = tail.load(std::memory_order_relaxed);
+                size_t n;
+                while (true) {
+                    n = 0;
+                    while (n < count && cells[(pos + n) & mask].sequence.load(std::memory_order_acquire) == pos + n)
+                        n++;
+                    if (n == 0) {
+                        size_t seq = cells[pos & mask].sequence.load(std::memory_order_acquire);
+                        if ((long)(seq - pos) < 0)
+                            return 0;
+                        pos = tail.load(std::memory_order_relaxed);
+                        continue;
+                    }
+                    if (tail.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed))
+                        break;
+                }
+                for (size_t i = 0; i < n; i++) {
+                    Cell * cell = &cells[(pos + i) & mask];
+                    new (cell->item()) T(items[i]);
+                    cell->sequence.store(pos + i + 1, std::memory_order_release);
+                }
+                waiters.notify();
+                return n;
+            }
+
+            // Same as pushBatch(), from the consumer side.
+            size_t popBatch(T * items, size_t count)
+            {
+                size_t pos = head.load(std::memory_order_relaxed);
+                size_t n;
+                while (true) {
+                    n = 0;
+                    while (n < count && cells[(pos + n) & mask].sequence.load(std::memory_order_acquire) == pos + n + 1)
+                        n++;
+                    if (n == 0) {
+                        size_t seq = cells[pos & mask].sequence.load(std::memory_order_acquire);
+                        if ((long)(seq - (pos + 1)) < 0)
+                            return 0;
+                        pos = head.load(std::memory_order_relaxed);
+                        continue;
+                    }
+                    if (head.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed))
+                        break;
+                }
+                for (size_t i = 0; i < n; i++)
+                    take(&cells[(pos + i) & mask], pos + i, items[i]);
+                waiters.notify();
+                return n;
+            }
+
+            template <typename U>
+            void push(U && item)
+            {
+                waiters.wait([&]() { return tryPush(std::forward<U>(item)); });
+            }
+
+            void pop(T & item)
+            {
+                waiters.wait([&]() { return tryPop(item); });
+            }
+
+            // a snapshot; may be off by the calls in flight
+            size_t size() const
+            {
+                size_t t = tail.load(std::memory_order_acquire);
+                size_t h = head.load(std::memory_order_acquire);
+                return t > h ? t - h : 0;
+            }
+
+            size_t getCapacity() const
+            {
+                return capacity;
+            }
+
+        private :
+            struct Cell {
+                std::atomic<size_t> sequence;
+                alignas(T) unsigned char storage[sizeof(T)];
+
+                T * item()
+                {
+                    return reinterpret_cast<T *>(storage);
+                }
+            };
+
+            const size_t        capacity;
+            const size_t        mask;
+            Cell * const        cells;
+            char                padding0[ringPadding];
+            std::atomic<size_t> tail;
+            char                padding1[ringPadding - sizeof(std::atomic<size_t>)];
+            std::atomic<size_t> head;
+            char                padding2[ringPadding - sizeof(std::atomic<size_t>)];
+            RingWaiters         waiters;
+
+            // moves the item out and frees the cell for the next lap
+            void take(Cell * cell, size_t pos, T & item)
+            {
+                T * slot = cell->item();
+                item = std::move(*slot);
+                slot->~T();
+                cell->sequence.store(pos + capacity, std::memory_order_release);
+            }
+
+            static size_t roundUp(size_t size)
+            {
+                size_t c = 2;
+                while (c < size)
+                    c <<= 1;
+                return c;
+            }
+    };
+}
+#endif // RINGBUFFER_H
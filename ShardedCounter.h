@@ -0,0 +1,95 @@
+#ifndef SHARDEDCOUNTER_H
+#define SHARDEDCOUNTER_H
+
+#include <cstddef>
+#include <atomic>
+#include <thread>
+
+#include "Common.h"
+
+namespace dt {
+
+    // a cell fills whole pairs of cache lines, as the adjacent line
+    // prefetcher pulls lines in pairs
+    const size_t counterPadding = 128;
+    // cells of a ShardedCounter when the hardware thread count is unknown
+    const size_t defaultCounterShards = 16;
+
+    // Cells of a ShardedCounter: the hardware threads rounded up to a power
+    // of two, so that threads only share a cell once there are more of
+    // them than the machine runs at a time.
+    inline size_t counterShards()
+    {
+        static const size_t shards = [] {
+            size_t threads = std::thread::hardware_concurrency();
+            if (threads == 0)
+                threads = defaultCounterShards;
+            size_t n = 1;
+            while (n < threads)
+                n <<= 1;
+            return n;
+        }();
+        return shards;
+    }
+
+    // Cell the calling thread adds to, handed out round robin.
+    inline size_t counterShard()
+    {
+        static std::atomic<size_t> next(0);
+        static thread_local size_t shard = next.fetch_add(1, std::memory_order_relaxed) & (counterShards() - 1);
+        return shard;
+    }
+
+    // N counters striped over per-thread cells. add() is a relaxed atomic
+    // add to the calling thread's own cell, which no other thread writes
+    // while there are no more threads than cells. approximate() sums the
+    // cells while adds go on and may miss the ones in flight.
+    template <size_t N = 1>
+    class ShardedCounter : noncopyable {
+        public :
+            ShardedCounter() : shards(counterShards()), cells(new Cell[counterShards()])
+            {
+                for (size_t i = 0; i < shards; i++)
+                    for (size_t c = 0; c < N; c++)
+                        cells[i].values[c].store(0, std::memory_order_relaxed);
+            }
+
+            ~ShardedCounter()
+            {
+                delete [] cells;
+            }
+
+            void add(long delta, size_t counter = 0)
+            {
+                cells[counterShard()].values[counter].fetch_add(delta, std::memory_order_relaxed);
+            }
+
+            long approximate(size_t counter = 0) const
+            {
+                long total = 0;
+                for (size_t i = 0; i < shards; i++)
+                    total += cells[i].values[counter].load(std::memory_order_relaxed);
+                return total;
+            }
+
+            // approximate() of all N counters at once
+            void approximate(long * totals) const
+            {
+                for (size_t c = 0; c < N; c++)
+                    totals[c] = 0;
+                for (size_t i = 0; i < shards; i++)
+                    for (size_t c = 0; c < N; c++)
+                        totals[c] += cells[i].values[c].load(std::memory_order_relaxed);
+            }
+
+        private :
+            // aligned so that no two cells share a line pair
+            struct alignas(counterPadding) Cell {
+                std::atomic<long>   values[N];
+            };
+
+            size_t  shards;
+            Cell *  cells;
+    };
+}
+#endif // SHARDEDCOUNTER_H
@@ -0,0 +1,75 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <cstddef>
+#include <string>
+#include <type_traits>
+#include <stdint.h>
+#include <string.h>
+
+namespace dt {
+
+    const char     snapshotMagic[8] = { 'D', 'T', 'S', 'N', 'A', 'P', '\r', '\n' };
+    const uint32_t snapshotVersion = 2;
+
+    // First bytes of a snapshot file, followed by count records of key,
+    // value and milliseconds left to the deadline (0: none). Fields are in
+    // host byte order: a snapshot is meant to be loaded back on the same
+    // kind of machine.
+    struct SnapshotHeader {
+        char        magic[8];
+        uint32_t    version;
+        uint32_t    headerSize;
+        uint64_t    count;
+        // sizeof(K) and sizeof(V) of the table that wrote it, to catch a load
+        // into a table of other types
+        uint32_t    keySize;
+        uint32_t    valueSize;
+    };
+
+    // Binary encoding of keys and values in snapshots. The default copies
+    // the bytes of trivially copyable types; other types specialize it with
+    // the same two functions. read() returns false when the record does
+    // not fit before end.
+    template <typename T, typename Enable = void>
+    struct Serializer {
+        static_assert(std::is_trivially_copyable<T>::value,
+                      "no snapshot encoding for this type: specialize dt::Serializer");
+
+        static void write(std::string & out, const T & value)
+        {
+            out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+        }
+
+        static bool read(const char *& pos, const char * end, T & value)
+        {
+            if ((size_t)(end - pos) < sizeof(T))
+                return false;
+            memcpy(&value, pos, sizeof(T));
+            pos += sizeof(T);
+            return true;
+        }
+    };
+
+    // strings are stored as a 32-bit length and their bytes
+    template <>
+    struct Serializer<std::string> {
+        static void write(std::string & out, const std::string & value)
+        {
+            uint32_t length = value.size();
+            out.append(reinterpret_cast<const char *>(&length), sizeof(length));
+            out.append(value);
+        }
+
+        static bool read(const char *& pos, const char * end, std::string & value)
+        {
+            uint32_t length;
+            if (!Serializer<uint32_t>::read(pos, end, length) || (size_t)(end - pos) < length)
+                return false;
+            value.assign(pos, length);
+            pos += length;
+            return true;
+        }
+    };
+}
+#endif // SNAPSHOT_H
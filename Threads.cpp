@@ -1,61 +1,211 @@
+
 #include "Threads.h"
 #include <vector>
 
-std::vector<dt::TimerCall> vec;
+dt::ThreadPool::ThreadPool(int count) : stopping(false)
+{
+    for (int i = 0; i < count; i++) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, run, this) != 0) {
+            printf("thread pool: pthread_create failed\n");
+            break;
+        }
+        threads.push_back(t);
+    }
+}
+
+dt::ThreadPool::~ThreadPool()
+{
+    {
+        Lock lock(&mutex);
+        stopping = true;
+        ready.broadcast();
+    }
+    for (size_t i = 0; i < threads.size(); i++)
+        pthread_join(threads[i], NULL);
+}
+
+void dt::ThreadPool::submit(void (* func)(void *), void * para)
+{
+    Task task;
+    task.func = func;
+    task.para = para;
+    Lock lock(&mutex);
+    tasks.push_back(task);
+    ready.signal();
+}
 
-void dt::Timer::timerHandler(int sig, siginfo_t *si, void *uc)
+void * dt::ThreadPool::run(void * para)
 {
-    timer_t *tidp = (timer_t *)si->si_value.sival_ptr;
-    printf("time handler is triggered\n");
-    for ( std::vector<TimerCall >::iterator itr = vec.begin(); itr != vec.end(); ++itr) {
-        timer_t id = *((*itr)._timer_t);
-        if (id == *tidp)  {
-            printf("execute command\n");
-            (*itr).func((*itr).para);
+    ThreadPool * pool = (ThreadPool *) para;
+    while (true) {
+        Task task;
+        {
+            Lock lock(&pool->mutex);
+            while (pool->tasks.empty() && !pool->stopping)
+                pool->ready.wait(&pool->mutex);
+            if (pool->tasks.empty())
+                return NULL;
+            task = pool->tasks.front();
+            pool->tasks.pop_front();
         }
+        task.func(task.para);
     }
 }
 
+namespace {
+    // one callback handed to the worker pool
+    struct PendingCall {
+        dt::Timer *     timer;
+        dt::TimerId     id;
+        void            (* func)(void *);
+        void *          para;
+    };
+}
 
-timer_t dt::Timer::create(long expireMS, int intervalMS, void (* callbackFunc) (void *), void * para)
+dt::TimerId dt::Timer::create(long expireMS, long intervalMS, void (* callbackFunc) (void *), void * para)
 {
-    //unsigned int id = getTimerId();
-    timer_t id;
-    
-    make(&id, expireMS, intervalMS);
+    Lock lock(&mutex);
+    if (!started) {
+        if (pthread_create(&thread, NULL, run, this) != 0) {
+            printf("timer: pthread_create failed\n");
+            return 0;
+        }
+        started = true;
+    }
+
+    TimerId id = nextId++;
     TimerCall call;
-    call._timer_t = &id;
-    printf("create timed 0x%lx, 0x%lx \n", (long)id, (long)(*(call._timer_t)));
     call.func = callbackFunc;
     call.para = para;
-    vec.push_back(call);
-    for ( std::vector<TimerCall >::iterator itr = vec.begin(); itr != vec.end(); ++itr) {
-            printf("stored = 0x%lx \n",(long)(*((*itr)._timer_t)));
-            
-    }
-    
+    call.intervalMS = intervalMS;
+    call.running = 0;
+    calls[id] = call;
+
+    Deadline d;
+    d.due = dt::monotonicMilliseconds() + expireMS;
+    d.id = id;
+    deadlines.push(d);
+    changed.broadcast();
     return id;
 }
 
+void dt::Timer::remove(TimerId timerID)
+{
+    Lock lock(&mutex);
+    std::map<TimerId, TimerCall>::iterator itr;
+    while ((itr = calls.find(timerID)) != calls.end() && itr->second.running > 0)
+        changed.wait(&mutex);
+    // its heap entry is skipped when it comes up
+    if (itr != calls.end())
+        calls.erase(itr);
+}
 
-void dt::Timer::remove(timer_t& timerID)
+void dt::Timer::setWorkers(int threads)
 {
-    size_t j = 0;
-    bool found = false;
-    for ( std::vector<TimerCall >::iterator itr = vec.begin(); itr != vec.end(); ++itr) {
-        timer_t id = *((*itr)._timer_t);
-        if (id == timerID) {
-            found = true;
-            break;
+    ThreadPool * pool = threads > 0 ? new ThreadPool(threads) : NULL;
+    ThreadPool * old;
+    {
+        Lock lock(&mutex);
+        old = workers;
+        workers = pool;
+    }
+    // drains the callbacks already handed to it
+    delete old;
+}
+
+void * dt::Timer::run(void * para)
+{
+    ((Timer *) para)->loop();
+    return NULL;
+}
+
+void dt::Timer::runCall(void * para)
+{
+    PendingCall * call = (PendingCall *) para;
+    call->func(call->para);
+    call->timer->finished(call->id);
+    delete call;
+}
+
+void dt::Timer::finished(TimerId id)
+{
+    Lock lock(&mutex);
+    release(id);
+}
+
+void dt::Timer::release(TimerId id)
+{
+    std::map<TimerId, TimerCall>::iterator itr = calls.find(id);
+    if (itr != calls.end()) {
+        itr->second.running -= 1;
+        // a one-shot timer is done once its callback has returned
+        if (itr->second.running == 0 && itr->second.intervalMS <= 0)
+            calls.erase(itr);
+    }
+    changed.broadcast();
+}
+
+void dt::Timer::loop()
+{
+    Lock lock(&mutex);
+    while (!stopping) {
+        if (deadlines.empty()) {
+            changed.wait(&mutex);
+            continue;
+        }
+
+        Deadline next = deadlines.top();
+        std::map<TimerId, TimerCall>::iterator itr = calls.find(next.id);
+        if (itr == calls.end()) {
+            deadlines.pop();
+            continue;
+        }
+        long long now = dt::monotonicMilliseconds();
+        if (next.due > now) {
+            changed.waitUntil(&mutex, next.due);
+            continue;
+        }
+
+        deadlines.pop();
+        TimerCall & call = itr->second;
+        if (call.intervalMS > 0) {
+            next.due += call.intervalMS;
+            // a late scheduler does not replay the periods it missed
+            if (next.due <= now)
+                next.due = now + call.intervalMS;
+            deadlines.push(next);
+        }
+        if (call.running > 0)
+            continue;
+
+        call.running += 1;
+        PendingCall * pending = new PendingCall();
+        pending->timer = this;
+        pending->id = next.id;
+        pending->func = call.func;
+        pending->para = call.para;
+
+        if (workers != NULL) {
+            workers->submit(runCall, pending);
+        } else {
+            mutex.unlock();
+            pending->func(pending->para);
+            mutex.tryLock();
+            delete pending;
+            release(next.id);
         }
-        j++;
     }
-    
-    if (found) 
+}
+
+dt::Timer::~Timer()
+{
     {
-        vec.erase(vec.begin() + j);
-        int ret = timer_delete(timerID);
-        if (ret != 0) 
-            printf ("delete timer failed , ret = %d", ret);
+        Lock lock(&mutex);
+        stopping = true;
+        changed.broadcast();
     }
+    if (started)
+        pthread_join(thread, NULL);
+    delete workers;
 }
@@ -2,12 +2,14 @@
 #define THREADS_H
 
 #include <vector>
+#include <deque>
+#include <map>
+#include <queue>
 #include <utility>
 
 #include <stdio.h>
 #include <unistd.h>
 #include <pthread.h>
-#include <signal.h>
 #include <time.h>
 
 #include "Common.h"
@@ -16,6 +18,7 @@ namespace dt {
    
     // A class ensuplates pthread_mutex
     class Mutex :noncopyable {
+        friend class Condition;
         public :  
             Mutex() {
                 if (pthread_mutex_init(&lock, NULL) != 0) {
@@ -54,6 +57,7 @@ namespace dt {
    class ReadWriteMutex : noncopyable {
     friend class ReadLock ;
     friend class WriteLock;
+    friend class TryWriteLock;
    public :
          ReadWriteMutex() {
            pthread_rwlock_init(&lock, NULL);  
@@ -70,6 +74,19 @@ namespace dt {
        ReadLock(ReadWriteMutex * m): mutex(m) {
           pthread_rwlock_rdlock(&mutex->lock);    
        }
+
+       // tries first and, if the lock is taken, stores the nanoseconds spent
+       // waiting for it in waitedNs; a NULL waitedNs just locks
+       ReadLock(ReadWriteMutex * m, long long * waitedNs): mutex(m) {
+           if (waitedNs == NULL || pthread_rwlock_tryrdlock(&mutex->lock) == 0) {
+               if (waitedNs == NULL)
+                   pthread_rwlock_rdlock(&mutex->lock);
+               return;
+           }
+           long long begin = monotonicNanoseconds();
+           pthread_rwlock_rdlock(&mutex->lock);
+           *waitedNs = monotonicNanoseconds() - begin;
+       }
        
        ~ReadLock() {
            pthread_rwlock_unlock(&mutex->lock);
@@ -84,6 +101,18 @@ namespace dt {
         WriteLock(ReadWriteMutex * m): mutex(m) {
             pthread_rwlock_wrlock(&mutex->lock);    
         }
+
+        // same as the ReadLock one
+        WriteLock(ReadWriteMutex * m, long long * waitedNs): mutex(m) {
+            if (waitedNs == NULL || pthread_rwlock_trywrlock(&mutex->lock) == 0) {
+                if (waitedNs == NULL)
+                    pthread_rwlock_wrlock(&mutex->lock);
+                return;
+            }
+            long long begin = monotonicNanoseconds();
+            pthread_rwlock_wrlock(&mutex->lock);
+            *waitedNs = monotonicNanoseconds() - begin;
+        }
         
         ~WriteLock() {
             pthread_rwlock_unlock(&mutex->lock);
@@ -93,25 +122,136 @@ namespace dt {
         ReadWriteMutex * mutex;
    };
 
-   static void timerHandler( int sig, siginfo_t *si, void *uc );
+   // Takes the write lock only if it is free right away; acquired() tells.
+   class TryWriteLock : noncopyable {
+    public:
+        TryWriteLock(ReadWriteMutex * m): mutex(m), held(pthread_rwlock_trywrlock(&m->lock) == 0) {
+        }
+
+        ~TryWriteLock() {
+            if (held)
+                pthread_rwlock_unlock(&mutex->lock);
+        }
+
+        bool acquired() const {
+            return held;
+        }
+
+    private :
+        ReadWriteMutex * mutex;
+        bool             held;
+   };
+
+   // A condition variable bound to a Mutex, timed against CLOCK_MONOTONIC.
+   class Condition : noncopyable {
+   public :
+       Condition() {
+           pthread_condattr_t attr;
+           pthread_condattr_init(&attr);
+           pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+           pthread_cond_init(&cond, &attr);
+           pthread_condattr_destroy(&attr);
+       }
+
+       ~Condition() {
+           pthread_cond_destroy(&cond);
+       }
+
+       void wait(Mutex * m) {
+           pthread_cond_wait(&cond, &m->lock);
+       }
+
+       // waits until the monotonic clock reaches deadlineMS
+       void waitUntil(Mutex * m, long long deadlineMS) {
+           struct timespec ts;
+           ts.tv_sec = deadlineMS / 1000;
+           ts.tv_nsec = (deadlineMS % 1000) * 1000000;
+           pthread_cond_timedwait(&cond, &m->lock, &ts);
+       }
+
+       void signal() {
+           pthread_cond_signal(&cond);
+       }
+
+       void broadcast() {
+           pthread_cond_broadcast(&cond);
+       }
+
+   private :
+       pthread_cond_t cond;
+   };
+
+   // Fixed set of threads running submitted tasks in FIFO order.
+   class ThreadPool : noncopyable {
+   public :
+       ThreadPool(int threads);
+
+       // drains the queue, then joins the threads
+       ~ThreadPool();
+
+       void submit(void (* func)(void *), void * para);
+
+   private :
+       struct Task {
+           void (* func)(void *);
+           void * para;
+       };
+
+       Mutex               mutex;
+       Condition           ready;
+       std::deque<Task>    tasks;
+       std::vector<pthread_t> threads;
+       bool                stopping;
+
+       static void * run(void * para);
+   };
+
+   typedef long TimerId;
 
    struct TimerCall{
-       timer_t * _timer_t;
        void (* func) (void *) ;
        void * para ;
+       long intervalMS;
+       // callbacks of this timer currently executing
+       int running;
    };
    
-   ///In linux, timer is one per process, thus
-   /// define it as a singleton class, for defining
-   /// multiple timers, try call create timer 
+   // One scheduler thread serving every timer in the process, driven by a
+   // min-heap of deadlines and a condition variable on the monotonic clock.
+   // Callbacks run on the scheduler thread, or on a worker pool once
+   // setWorkers() has been called; a timer whose previous callback is still
+   // running skips that period rather than running twice at once.
    class Timer : noncopyable{
         private :
-            
-            Mutex * mutex;
-            Timer() {
-                //mutex = new Mutex();
+            struct Deadline {
+                long long   due;
+                TimerId     id;
+
+                bool operator<(const Deadline & other) const {
+                    // std::priority_queue keeps the largest on top
+                    return due > other.due;
+                }
+            };
+
+            Mutex                           mutex;
+            Condition                       changed;
+            std::priority_queue<Deadline>   deadlines;
+            std::map<TimerId, TimerCall>    calls;
+            TimerId                         nextId;
+            ThreadPool *                    workers;
+            pthread_t                       thread;
+            bool                            started;
+            bool                            stopping;
+
+            Timer() : nextId(1), workers(NULL), started(false), stopping(false) {
             }   
-            static void timerHandler(int sig, siginfo_t *si, void *uc);
+
+            static void * run(void * para);
+            static void runCall(void * para);
+            void loop();
+            void finished(TimerId id);
+            // called with mutex held when a callback has returned
+            void release(TimerId id);
         public :
             static Timer& getInstance()
             {
@@ -119,45 +259,20 @@ namespace dt {
                 return INSTANCE;
             }
         
-        timer_t create(long expireMS, int intervalMS, void (* callbackFunc)(void *), void * para);
-        
-        void remove(timer_t & timerID);
+        // Calls callbackFunc(para) first after expireMS, then every
+        // intervalMS (once only when intervalMS is 0).
+        TimerId create(long expireMS, long intervalMS, void (* callbackFunc)(void *), void * para);
         
-        int make(timer_t *timerID, int expireSecond, int intervalSecond )
-        {
-            //sigset_t mask;
-            struct sigevent         te;
-            struct itimerspec       its;
-            struct sigaction        sa;
-            int                     sigNo = SIGRTMIN;
-
-            /* Set up signal handler. */
-            sa.sa_flags = SA_SIGINFO;
-            sa.sa_sigaction = timerHandler;
-            sigemptyset(&sa.sa_mask);
-            if (sigaction(sigNo, &sa, NULL) == -1)
-            {
-                perror("sigaction");
-            }
-
-            /* Set and enable alarm */
-            te.sigev_notify = SIGEV_SIGNAL;
-            te.sigev_signo = sigNo;
-            te.sigev_value.sival_ptr = timerID;
-            timer_create(CLOCK_REALTIME, &te, timerID);
+        // Cancels the timer and waits for a running callback to return, so
+        // para may be destroyed afterwards. Must not be called from the
+        // timer's own callback.
+        void remove(TimerId timerID);
 
-            its.it_interval.tv_sec = intervalSecond;
-            its.it_interval.tv_nsec = 0;
-            its.it_value.tv_sec = expireSecond ;
-            its.it_value.tv_nsec = 0;
-            timer_settime(*timerID, 0, &its, NULL);
-
-            return 1;
-        }
+        // Runs callbacks on a pool of threads instead of the scheduler
+        // thread; 0 goes back to the scheduler thread.
+        void setWorkers(int threads);
     
-        ~Timer() {
-            delete mutex;
-        }
+        ~Timer();
       };
     
 }
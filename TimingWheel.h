@@ -0,0 +1,132 @@
+#ifndef TIMINGWHEEL_H
+#define TIMINGWHEEL_H
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include "Common.h"
+
+namespace dt {
+
+    // width of one wheel tick
+    const timemilliseconds wheelResolutionMs = 10;
+
+    // Deadline of one table entry, as kept in the expiry index. The hash is
+    // stored so that firing it needs no rehash of the key.
+    template <typename K>
+    struct ExpiryRecord {
+        K                   key;
+        unsigned long       hash;
+        timemilliseconds    deadline;
+
+        ExpiryRecord(const K & k, unsigned long h, const timemilliseconds & d) : key(k), hash(h), deadline(d) {}
+    };
+
+    // Hierarchical timing wheel: four levels of 64 slots, each level 64
+    // times coarser than the one below, covering 64^4 ticks ahead of the
+    // current tick (about 46 hours at 10ms). add() is O(1); advance() only
+    // touches the slots it passes and the records in them, and moves records
+    // down a level whenever the level below wraps around.
+    template <typename T>
+    class TimingWheel : noncopyable {
+        public :
+            TimingWheel(const timemilliseconds & now, const timemilliseconds & resolution = wheelResolutionMs) :
+                resolutionMs(resolution), current(now / resolution), count(0)
+            {
+            }
+
+            size_t size() const
+            {
+                return count;
+            }
+
+            void add(const T & record)
+            {
+                timemilliseconds tick = (record.deadline + resolutionMs - 1) / resolutionMs;
+                // the slot of the current tick has been handed out already
+                place(T(record), tick > current ? tick : current + 1);
+                count += 1;
+            }
+
+            // Moves the wheel towards now and moves up to limit records due by
+            // then out of their slots into due. Once limit is reached it stays
+            // on the tick with records left, and the next call resumes there.
+            // Returns the number of records handed out.
+            size_t advance(const timemilliseconds & now, std::vector<T> & due, size_t limit = (size_t) -1)
+            {
+                timemilliseconds target = now / resolutionMs;
+                size_t taken = 0;
+                for (;;) {
+                    std::vector<T> & slot = slots[0][current & slotMask];
+                    for (; !slot.empty() && taken < limit; taken++) {
+                        due.push_back(std::move(slot.back()));
+                        slot.pop_back();
+                        count -= 1;
+                    }
+                    if (!slot.empty() || current >= target)
+                        return taken;
+                    if (count == 0) {
+                        current = target;
+                        return taken;
+                    }
+                    current += 1;
+                    size_t index = current & slotMask;
+                    // each wrap of a level pulls the next slot of the level above down
+                    for (int level = 1; index == 0 && level < levels; level++) {
+                        index = (current >> (level * levelBits)) & slotMask;
+                        cascade(slots[level][index]);
+                    }
+                    if ((current & ((1LL << (levels * levelBits)) - 1)) == 0)
+                        cascade(overflow);
+                }
+            }
+
+            void clear()
+            {
+                for (int level = 0; level < levels; level++)
+                    for (size_t i = 0; i < slotCount; i++)
+                        slots[level][i].clear();
+                overflow.clear();
+                count = 0;
+            }
+
+        private :
+            static const int    levelBits = 6;
+            static const size_t slotCount = 1 << levelBits;
+            static const size_t slotMask = slotCount - 1;
+            static const int    levels = 4;
+
+            timemilliseconds    resolutionMs;
+            // last tick advance() entered; its slot keeps what a limited
+            // advance() left there
+            timemilliseconds    current;
+            size_t              count;
+            std::vector<T>      slots[levels][slotCount];
+            // further out than the top level reaches
+            std::vector<T>      overflow;
+
+            // tick is never behind current: add() moves it past, and cascaded
+            // records are at worst due on the tick being entered
+            void place(T && record, timemilliseconds tick)
+            {
+                timemilliseconds delta = tick - current;
+                for (int level = 0; level < levels; level++) {
+                    if (delta < (1LL << ((level + 1) * levelBits))) {
+                        slots[level][(tick >> (level * levelBits)) & slotMask].push_back(std::move(record));
+                        return;
+                    }
+                }
+                overflow.push_back(std::move(record));
+            }
+
+            void cascade(std::vector<T> & slot)
+            {
+                std::vector<T> moving;
+                moving.swap(slot);
+                for (size_t i = 0; i < moving.size(); i++)
+                    place(std::move(moving[i]), (moving[i].deadline + resolutionMs - 1) / resolutionMs);
+            }
+    };
+}
+#endif // TIMINGWHEEL_H
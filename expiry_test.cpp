@@ -0,0 +1,87 @@
+//
+//  expiry_test.cpp
+//
+//  Checks that every way of reading a table, point reads and iteration
+//  alike, misses an entry once its deadline has passed, before any sweep
+//  has removed it. The table clock is driven by hand, so no sweep runs.
+//
+
+#include <stdio.h>
+
+#include "Hashtable.h"
+
+namespace {
+
+    dt::timemilliseconds manualNow = 1000000;
+
+    dt::timemilliseconds manualClock()
+    {
+        return manualNow;
+    }
+
+    int failures = 0;
+
+    void check(bool ok, const char * storage, const char * what)
+    {
+        if (!ok) {
+            printf("FAIL %s: %s\n", storage, what);
+            failures += 1;
+        }
+    }
+
+    template <typename S>
+    void scanAfterDeadline(const char * storage)
+    {
+        dt::HashtableOptions options;
+        options.clock = manualClock;
+        options.sweepMs = 3600 * 1000L;
+        dt::Hashtable<unsigned long, unsigned long, dt::KeyHash<unsigned long>, S> table(options);
+        for (unsigned long k = 0; k < 100; k++)
+            table.put(k, k);
+        table.put(1000, 1000, 30);
+        manualNow += 100;
+
+        unsigned long value;
+        check(!table.get(1000, value), storage, "get() after the deadline");
+
+        size_t seen = 0;
+        bool expired = false;
+        unsigned long cursor = 0;
+        do {
+            cursor = table.scan(cursor, [&](const unsigned long & key, const unsigned long &) {
+                seen += 1;
+                expired = expired || key == 1000;
+            });
+        } while (cursor != 0);
+        check(seen == 100 && !expired, storage, "scan() after the deadline");
+
+        std::atomic<size_t> visited(0);
+        std::atomic<bool> found(false);
+        table.parallelForEach([&](const unsigned long & key, const unsigned long &) {
+            visited += 1;
+            if (key == 1000)
+                found = true;
+        }, 4);
+        check(visited == 100 && !found, storage, "parallelForEach() after the deadline");
+
+        dt::Iterator<unsigned long, unsigned long, dt::KeyHash<unsigned long>, S> it = table.keys();
+        unsigned long key;
+        seen = 0;
+        expired = false;
+        while (it.hasNext()) {
+            it.next(key, value);
+            seen += 1;
+            expired = expired || key == 1000;
+        }
+        check(seen == 100 && !expired, storage, "keys() after the deadline");
+    }
+}
+
+int main()
+{
+    scanAfterDeadline<dt::ChainedStorage<> >("chained");
+    scanAfterDeadline<dt::FlatStorage>("flat");
+    if (failures == 0)
+        printf("expiry_test: ok\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,451 @@
+//
+//  hashtable_bench.cpp
+//
+//  Drives dt::Hashtable from several threads with a configurable mix of
+//  get / put / remove over uniform or Zipfian keys, and reports throughput
+//  and latency percentiles per configuration, as text or as JSON lines.
+//
+//  hashtable_bench [--threads=1,2,4,8] [--sizes=16384,1048576] [--mix=80,15,5]
+//                  [--dist=uniform,zipf] [--theta=0.99] [--keys=int,string]
+//                  [--ttl=0,1] [--storage=chained,flat,compact] [--readmode=locked]
+//                  [--writemode=locked] [--seconds=2] [--json]
+//
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "Hashtable.h"
+#include "StringUtils.h"
+
+namespace {
+
+    struct BenchConfig {
+        std::vector<int>            threads;
+        std::vector<size_t>         sizes;
+        // percentages of get, put and remove; they add up to 100
+        int                         readPct;
+        int                         writePct;
+        int                         removePct;
+        std::vector<std::string>    dists;
+        double                      theta;
+        std::vector<std::string>    keyTypes;
+        std::vector<int>            ttls;
+        std::vector<std::string>    storages;
+        dt::ReadMode                readMode;
+        dt::WriteMode               writeMode;
+        double                      seconds;
+        bool                        json;
+
+        BenchConfig() : readPct(80), writePct(15), removePct(5), theta(0.99), readMode(dt::ReadLocked), writeMode(dt::WriteLocked), seconds(2), json(false)
+        {
+            threads.push_back(1);
+            threads.push_back(2);
+            threads.push_back(4);
+            threads.push_back(8);
+            // fits in L2, and well beyond the last level cache
+            sizes.push_back(1 << 14);
+            sizes.push_back(1 << 22);
+            dists.push_back("uniform");
+            dists.push_back("zipf");
+            keyTypes.push_back("int");
+            keyTypes.push_back("string");
+            ttls.push_back(0);
+            ttls.push_back(1);
+            storages.push_back("chained");
+        }
+    };
+
+    inline unsigned long long nowNs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (unsigned long long) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    }
+
+    // Spreads key ranks over the whole 64-bit range (the murmur3 finalizer).
+    inline unsigned long scramble(unsigned long x)
+    {
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdUL;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53UL;
+        x ^= x >> 33;
+        return x;
+    }
+
+    // splitmix64: small, fast and good enough to pick keys and operations
+    class Random {
+        public :
+            explicit Random(unsigned long seed) : state(seed) {}
+
+            unsigned long next()
+            {
+                unsigned long z = (state += 0x9E3779B97F4A7C15UL);
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9UL;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebUL;
+                return z ^ (z >> 31);
+            }
+
+            // uniform in [0, 1)
+            double nextDouble()
+            {
+                return (next() >> 11) * (1.0 / 9007199254740992.0);
+            }
+
+        private :
+            unsigned long state;
+    };
+
+    // Zipfian ranks in [0, n) after Gray et al., "Quickly generating
+    // billion-record synthetic databases" (the YCSB generator): O(n) setup,
+    // O(1) per draw. Rank 0 is the hottest key.
+    class ZipfGenerator {
+        public :
+            ZipfGenerator(size_t count, double theta) : n(count), theta(theta)
+            {
+                zetan = zeta(n, theta);
+                double zeta2 = zeta(2, theta);
+                alpha = 1.0 / (1.0 - theta);
+                eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zetan);
+                half = 1.0 + pow(0.5, theta);
+            }
+
+            size_t next(Random & random) const
+            {
+                double u = random.nextDouble();
+                double uz = u * zetan;
+                if (uz < 1.0)
+                    return 0;
+                if (uz < half)
+                    return 1;
+                size_t rank = (size_t)(n * pow(eta * u - eta + 1.0, alpha));
+                return rank < n ? rank : n - 1;
+            }
+
+        private :
+            size_t  n;
+            double  theta;
+            double  zetan;
+            double  alpha;
+            double  eta;
+            double  half;
+
+            static double zeta(size_t count, double theta)
+            {
+                double sum = 0;
+                for (size_t i = 1; i <= count; i++)
+                    sum += 1.0 / pow((double) i, theta);
+                return sum;
+            }
+    };
+
+    // Log-linear latency histogram: every power of two is split into 16
+    // linear sub-buckets, which keeps the relative error under 1/16.
+    class LatencyHistogram {
+        public :
+            LatencyHistogram() : counts(bucketCount, 0), total(0) {}
+
+            void record(unsigned long long ns)
+            {
+                counts[index(ns)] += 1;
+                total += 1;
+            }
+
+            void merge(const LatencyHistogram & other)
+            {
+                for (size_t i = 0; i < bucketCount; i++)
+                    counts[i] += other.counts[i];
+                total += other.total;
+            }
+
+            // lower bound of the bucket holding the p-th fraction of samples
+            unsigned long long percentile(double p) const
+            {
+                unsigned long long rank = (unsigned long long) ceil(p * total);
+                unsigned long long seen = 0;
+                for (size_t i = 0; i < bucketCount; i++) {
+                    seen += counts[i];
+                    if (seen >= rank && seen > 0)
+                        return lowerBound(i);
+                }
+                return 0;
+            }
+
+        private :
+            static const int    subBits = 4;
+            static const size_t bucketCount = (64 - subBits + 1) << subBits;
+
+            std::vector<unsigned long long> counts;
+            unsigned long long              total;
+
+            static size_t index(unsigned long long v)
+            {
+                if (v < (1ull << subBits))
+                    return (size_t) v;
+                int exponent = 63 - __builtin_clzll(v);
+                size_t sub = (v >> (exponent - subBits)) & ((1 << subBits) - 1);
+                return ((exponent - subBits + 1) << subBits) + sub;
+            }
+
+            static unsigned long long lowerBound(size_t i)
+            {
+                if (i < (1u << subBits))
+                    return i;
+                int exponent = (int)(i >> subBits) + subBits - 1;
+                unsigned long long sub = i & ((1 << subBits) - 1);
+                return (1ull << exponent) | (sub << (exponent - subBits));
+            }
+    };
+
+    template <typename K>
+    struct KeyTraits;
+
+    template <>
+    struct KeyTraits<unsigned long> {
+        typedef dt::KeyHash<unsigned long> Hash;
+
+        static unsigned long make(size_t rank)
+        {
+            return scramble(rank);
+        }
+    };
+
+    template <>
+    struct KeyTraits<std::string> {
+        typedef dt::KeyHash<std::string> Hash;
+
+        // about the length of a typical session or object id
+        static std::string make(size_t rank)
+        {
+            char buffer[48];
+            snprintf(buffer, sizeof(buffer), "key:%016lx:%08zu", scramble(rank), rank);
+            return buffer;
+        }
+    };
+
+    struct RunResult {
+        unsigned long long  ops;
+        double              seconds;
+        LatencyHistogram    latency;
+    };
+
+    template <typename K, typename S>
+    RunResult runOne(const BenchConfig & config, int threadCount, size_t size, bool zipf, bool ttl)
+    {
+        typedef dt::Hashtable<K, unsigned long, typename KeyTraits<K>::Hash, S> Table;
+
+        dt::HashtableOptions options;
+        options.capacity = (int) size;
+        options.readMode = config.readMode;
+        options.writeMode = config.writeMode;
+        // the entries never actually expire; the point is the timestamp and
+        // expiry index upkeep on every write
+        options.periodSeconds = ttl ? 3600 : 0;
+
+        std::vector<K> keys(size);
+        for (size_t i = 0; i < size; i++)
+            keys[i] = KeyTraits<K>::make(i);
+
+        Table table(options);
+        for (size_t i = 0; i < size; i++)
+            table.put(keys[i], i);
+
+        ZipfGenerator zipfian(zipf ? size : 2, config.theta);
+        std::atomic<bool> start(false);
+        std::atomic<bool> stop(false);
+        std::vector<unsigned long long> ops(threadCount, 0);
+        std::vector<LatencyHistogram> latencies(threadCount);
+        std::vector<std::thread> threads;
+
+        for (int t = 0; t < threadCount; t++) {
+            threads.push_back(std::thread([&, t]() {
+                Random random(0x1234567 + t * 7919);
+                LatencyHistogram & latency = latencies[t];
+                unsigned long long done = 0;
+                unsigned long value;
+                while (!start.load(std::memory_order_acquire))
+                    ;
+                while (!stop.load(std::memory_order_relaxed)) {
+                    size_t rank = zipf ? zipfian.next(random) : random.next() % size;
+                    const K & key = keys[rank];
+                    int op = (int)(random.next() % 100);
+
+                    unsigned long long begin = nowNs();
+                    if (op < config.readPct)
+                        table.get(key, value);
+                    else if (op < config.readPct + config.writePct)
+                        table.put(key, rank);
+                    else
+                        table.remove(key);
+                    latency.record(nowNs() - begin);
+                    done += 1;
+                }
+                ops[t] = done;
+            }));
+        }
+
+        unsigned long long begin = nowNs();
+        start.store(true, std::memory_order_release);
+        struct timespec pause;
+        pause.tv_sec = (time_t) config.seconds;
+        pause.tv_nsec = (long)((config.seconds - pause.tv_sec) * 1e9);
+        nanosleep(&pause, NULL);
+        stop.store(true);
+        for (size_t t = 0; t < threads.size(); t++)
+            threads[t].join();
+
+        RunResult result;
+        result.seconds = (nowNs() - begin) / 1e9;
+        result.ops = 0;
+        for (int t = 0; t < threadCount; t++) {
+            result.ops += ops[t];
+            result.latency.merge(latencies[t]);
+        }
+        return result;
+    }
+
+    RunResult runConfig(const BenchConfig & config, const std::string & storage, const std::string & keyType, int threads, size_t size, bool zipf, bool ttl)
+    {
+        if (storage == "flat") {
+            if (keyType == "string")
+                return runOne<std::string, dt::FlatStorage>(config, threads, size, zipf, ttl);
+            return runOne<unsigned long, dt::FlatStorage>(config, threads, size, zipf, ttl);
+        }
+        if (storage == "compact") {
+            if (keyType == "string")
+                return runOne<std::string, dt::CompactStorage<> >(config, threads, size, zipf, ttl);
+            return runOne<unsigned long, dt::CompactStorage<> >(config, threads, size, zipf, ttl);
+        }
+        if (keyType == "string")
+            return runOne<std::string, dt::ChainedStorage<> >(config, threads, size, zipf, ttl);
+        return runOne<unsigned long, dt::ChainedStorage<> >(config, threads, size, zipf, ttl);
+    }
+
+    std::vector<std::string> values(const char * arg)
+    {
+        return mt::split(std::string(arg), ",");
+    }
+
+    bool parse(int argc, char ** argv, BenchConfig & config)
+    {
+        for (int i = 1; i < argc; i++) {
+            const char * arg = argv[i];
+            const char * eq = strchr(arg, '=');
+            std::string name(arg, eq != NULL ? eq - arg : strlen(arg));
+            const char * value = eq != NULL ? eq + 1 : "";
+
+            if (name == "--json") {
+                config.json = true;
+            } else if (name == "--threads") {
+                std::vector<std::string> v = values(value);
+                config.threads.clear();
+                for (size_t j = 0; j < v.size(); j++)
+                    config.threads.push_back(atoi(v[j].c_str()));
+            } else if (name == "--sizes") {
+                std::vector<std::string> v = values(value);
+                config.sizes.clear();
+                for (size_t j = 0; j < v.size(); j++)
+                    config.sizes.push_back(strtoul(v[j].c_str(), NULL, 10));
+            } else if (name == "--mix") {
+                std::vector<std::string> v = values(value);
+                if (v.size() != 3)
+                    return false;
+                config.readPct = atoi(v[0].c_str());
+                config.writePct = atoi(v[1].c_str());
+                config.removePct = atoi(v[2].c_str());
+                if (config.readPct + config.writePct + config.removePct != 100)
+                    return false;
+            } else if (name == "--dist") {
+                config.dists = values(value);
+            } else if (name == "--theta") {
+                config.theta = atof(value);
+            } else if (name == "--keys") {
+                config.keyTypes = values(value);
+            } else if (name == "--ttl") {
+                std::vector<std::string> v = values(value);
+                config.ttls.clear();
+                for (size_t j = 0; j < v.size(); j++)
+                    config.ttls.push_back(atoi(v[j].c_str()));
+            } else if (name == "--storage") {
+                config.storages = values(value);
+            } else if (name == "--readmode") {
+                if (strcmp(value, "lockfree") == 0)
+                    config.readMode = dt::ReadLockFree;
+                else if (strcmp(value, "optimistic") == 0)
+                    config.readMode = dt::ReadOptimistic;
+                else
+                    config.readMode = dt::ReadLocked;
+            } else if (name == "--writemode") {
+                config.writeMode = strcmp(value, "combining") == 0 ? dt::WriteCombining : dt::WriteLocked;
+            } else if (name == "--seconds") {
+                config.seconds = atof(value);
+            } else {
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    BenchConfig config;
+    if (!parse(argc, argv, config)) {
+        fprintf(stderr, "usage: %s [--threads=1,2,4,8] [--sizes=16384,4194304] [--mix=read,write,remove]\n"
+                        "          [--dist=uniform,zipf] [--theta=0.99] [--keys=int,string] [--ttl=0,1]\n"
+                        "          [--storage=chained,flat,compact] [--readmode=locked|lockfree|optimistic]\n"
+                        "          [--writemode=locked|combining] [--seconds=2] [--json]\n", argv[0]);
+        return 1;
+    }
+
+    if (!config.json)
+        printf("%-8s %-7s %-7s %10s %4s %8s %14s %8s %9s %9s %9s\n",
+               "storage", "keys", "dist", "size", "ttl", "threads", "ops/sec", "scaling", "p50(ns)", "p99(ns)", "p99.9(ns)");
+
+    for (size_t s = 0; s < config.storages.size(); s++)
+    for (size_t k = 0; k < config.keyTypes.size(); k++)
+    for (size_t d = 0; d < config.dists.size(); d++)
+    for (size_t z = 0; z < config.sizes.size(); z++)
+    for (size_t t = 0; t < config.ttls.size(); t++) {
+        double baseline = 0;
+        for (size_t n = 0; n < config.threads.size(); n++) {
+            const std::string & storage = config.storages[s];
+            const std::string & keyType = config.keyTypes[k];
+            const std::string & dist = config.dists[d];
+            size_t size = config.sizes[z];
+            int ttl = config.ttls[t];
+            int threads = config.threads[n];
+
+            RunResult r = runConfig(config, storage, keyType, threads, size, dist == "zipf", ttl != 0);
+            double rate = r.ops / r.seconds;
+            // throughput relative to the first thread count of the list
+            if (n == 0)
+                baseline = rate;
+            double scaling = baseline > 0 ? rate / baseline : 0;
+
+            if (config.json) {
+                printf("{\"storage\":\"%s\",\"key_type\":\"%s\",\"dist\":\"%s\",\"theta\":%.2f,\"size\":%zu,\"ttl\":%s,"
+                       "\"read_mode\":\"%s\",\"write_mode\":\"%s\",\"mix\":[%d,%d,%d],\"threads\":%d,\"ops\":%llu,\"seconds\":%.3f,"
+                       "\"ops_per_sec\":%.0f,\"scaling\":%.3f,\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu}\n",
+                       storage.c_str(), keyType.c_str(), dist.c_str(), config.theta, size, ttl ? "true" : "false",
+                       config.readMode == dt::ReadLockFree ? "lockfree" : config.readMode == dt::ReadOptimistic ? "optimistic" : "locked",
+                       config.writeMode == dt::WriteCombining ? "combining" : "locked",
+                       config.readPct, config.writePct, config.removePct, threads, r.ops, r.seconds,
+                       rate, scaling, r.latency.percentile(0.5), r.latency.percentile(0.99), r.latency.percentile(0.999));
+            } else {
+                printf("%-8s %-7s %-7s %10zu %4d %8d %14.0f %8.2f %9llu %9llu %9llu\n",
+                       storage.c_str(), keyType.c_str(), dist.c_str(), size, ttl, threads,
+                       rate, scaling, r.latency.percentile(0.5), r.latency.percentile(0.99), r.latency.percentile(0.999));
+            }
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,268 @@
+//
+//  ring_bench.cpp
+//
+//  Moves a fixed number of items from producer threads to consumer threads
+//  through SpscRing, MpmcRing and a mutex-protected std::deque, one item or
+//  one batch per call, and reports the throughput of each, as text or as
+//  JSON lines.
+//
+//  ring_bench [--producers=1,2,4] [--consumers=1,2,4] [--batch=1,32]
+//             [--capacity=1024] [--items=10000000] [--queues=spsc,mpmc,mutex]
+//             [--json]
+//
+
+#include <atomic>
+#include <deque>
+#include <thread>
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "RingBuffer.h"
+#include "StringUtils.h"
+
+namespace {
+
+    struct BenchConfig {
+        std::vector<int>            producers;
+        std::vector<int>            consumers;
+        std::vector<size_t>         batches;
+        size_t                      capacity;
+        unsigned long               items;
+        std::vector<std::string>    queues;
+        bool                        json;
+
+        BenchConfig() : capacity(1024), items(10000000), json(false)
+        {
+            producers.push_back(1);
+            producers.push_back(2);
+            producers.push_back(4);
+            consumers.push_back(1);
+            consumers.push_back(2);
+            consumers.push_back(4);
+            batches.push_back(1);
+            batches.push_back(32);
+            queues.push_back("spsc");
+            queues.push_back("mpmc");
+            queues.push_back("mutex");
+        }
+    };
+
+    // The baseline: what the ingest threads did before, a deque under a
+    // mutex, with the same try / batch interface as the rings.
+    class MutexQueue {
+        public :
+            explicit MutexQueue(size_t size) : capacity(size) {}
+
+            bool tryPush(unsigned long item)
+            {
+                dt::Lock lock(&mutex);
+                if (items.size() >= capacity)
+                    return false;
+                items.push_back(item);
+                return true;
+            }
+
+            bool tryPop(unsigned long & item)
+            {
+                dt::Lock lock(&mutex);
+                if (items.empty())
+                    return false;
+                item = items.front();
+                items.pop_front();
+                return true;
+            }
+
+            size_t pushBatch(const unsigned long * batch, size_t count)
+            {
+                dt::Lock lock(&mutex);
+                size_t n = 0;
+                while (n < count && items.size() < capacity)
+                    items.push_back(batch[n++]);
+                return n;
+            }
+
+            size_t popBatch(unsigned long * batch, size_t count)
+            {
+                dt::Lock lock(&mutex);
+                size_t n = 0;
+                while (n < count && !items.empty()) {
+                    batch[n++] = items.front();
+                    items.pop_front();
+                }
+                return n;
+            }
+
+        private :
+            size_t                      capacity;
+            dt::Mutex                   mutex;
+            std::deque<unsigned long>   items;
+    };
+
+    struct RunResult {
+        double          seconds;
+        // sum of the items consumed, to check that none was lost or doubled
+        unsigned long   sum;
+    };
+
+    // Each producer pushes its share of 1..items, spinning (with a yield)
+    // while the queue is full; consumers pop until they have seen them all.
+    template <typename Q>
+    RunResult runQueue(Q & queue, int producers, int consumers, size_t batch, unsigned long items)
+    {
+        std::atomic<unsigned long> consumed(0);
+        std::atomic<unsigned long> sum(0);
+        std::vector<std::thread> threads;
+        long long begin = dt::monotonicNanoseconds();
+
+        for (int p = 0; p < producers; p++) {
+            threads.push_back(std::thread([&, p]() {
+                std::vector<unsigned long> buffer(batch);
+                unsigned long next = p + 1;
+                while (next <= items) {
+                    if (batch == 1) {
+                        while (!queue.tryPush(next))
+                            std::this_thread::yield();
+                        next += producers;
+                        continue;
+                    }
+                    size_t n = 0;
+                    for (unsigned long v = next; n < batch && v <= items; v += producers)
+                        buffer[n++] = v;
+                    size_t done = 0;
+                    while (done < n) {
+                        size_t pushed = queue.pushBatch(&buffer[done], n - done);
+                        if (pushed == 0)
+                            std::this_thread::yield();
+                        done += pushed;
+                    }
+                    next += n * producers;
+                }
+            }));
+        }
+        for (int c = 0; c < consumers; c++) {
+            threads.push_back(std::thread([&]() {
+                std::vector<unsigned long> buffer(batch);
+                unsigned long local = 0;
+                while (consumed.load(std::memory_order_relaxed) < items) {
+                    size_t n;
+                    if (batch == 1)
+                        n = queue.tryPop(buffer[0]) ? 1 : 0;
+                    else
+                        n = queue.popBatch(&buffer[0], batch);
+                    if (n == 0) {
+                        std::this_thread::yield();
+                        continue;
+                    }
+                    for (size_t i = 0; i < n; i++)
+                        local += buffer[i];
+                    consumed.fetch_add(n, std::memory_order_relaxed);
+                }
+                sum.fetch_add(local);
+            }));
+        }
+        for (size_t i = 0; i < threads.size(); i++)
+            threads[i].join();
+
+        RunResult r;
+        r.seconds = (dt::monotonicNanoseconds() - begin) / 1e9;
+        r.sum = sum.load();
+        return r;
+    }
+
+    std::vector<std::string> values(const char * arg)
+    {
+        return mt::split(std::string(arg), ",");
+    }
+
+    bool parse(int argc, char ** argv, BenchConfig & config)
+    {
+        for (int i = 1; i < argc; i++) {
+            const char * arg = argv[i];
+            const char * eq = strchr(arg, '=');
+            std::string name(arg, eq != NULL ? eq - arg : strlen(arg));
+            const char * value = eq != NULL ? eq + 1 : "";
+
+            if (name == "--json") {
+                config.json = true;
+            } else if (name == "--producers" || name == "--consumers") {
+                std::vector<std::string> v = values(value);
+                std::vector<int> & counts = name == "--producers" ? config.producers : config.consumers;
+                counts.clear();
+                for (size_t j = 0; j < v.size(); j++)
+                    counts.push_back(atoi(v[j].c_str()));
+            } else if (name == "--batch") {
+                std::vector<std::string> v = values(value);
+                config.batches.clear();
+                for (size_t j = 0; j < v.size(); j++)
+                    config.batches.push_back(strtoul(v[j].c_str(), NULL, 10));
+            } else if (name == "--capacity") {
+                config.capacity = strtoul(value, NULL, 10);
+            } else if (name == "--items") {
+                config.items = strtoul(value, NULL, 10);
+            } else if (name == "--queues") {
+                config.queues = values(value);
+            } else {
+                return false;
+            }
+        }
+        return config.capacity > 0 && config.items > 0;
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    BenchConfig config;
+    if (!parse(argc, argv, config)) {
+        fprintf(stderr, "usage: %s [--producers=1,2,4] [--consumers=1,2,4] [--batch=1,32] [--capacity=1024]\n"
+                        "          [--items=10000000] [--queues=spsc,mpmc,mutex] [--json]\n", argv[0]);
+        return 1;
+    }
+
+    if (!config.json)
+        printf("%-6s %9s %9s %6s %14s %6s\n", "queue", "producers", "consumers", "batch", "items/sec", "check");
+
+    unsigned long expected = config.items * (config.items + 1) / 2;
+    for (size_t q = 0; q < config.queues.size(); q++)
+    for (size_t p = 0; p < config.producers.size(); p++)
+    for (size_t c = 0; c < config.consumers.size(); c++)
+    for (size_t b = 0; b < config.batches.size(); b++) {
+        const std::string & queue = config.queues[q];
+        int producers = config.producers[p];
+        int consumers = config.consumers[c];
+        size_t batch = config.batches[b] > 0 ? config.batches[b] : 1;
+        // one producer and one consumer is all an SPSC ring allows
+        if (queue == "spsc" && (producers != 1 || consumers != 1))
+            continue;
+
+        RunResult r;
+        if (queue == "spsc") {
+            dt::SpscRing<unsigned long> ring(config.capacity);
+            r = runQueue(ring, producers, consumers, batch, config.items);
+        } else if (queue == "mpmc") {
+            dt::MpmcRing<unsigned long> ring(config.capacity);
+            r = runQueue(ring, producers, consumers, batch, config.items);
+        } else if (queue == "mutex") {
+            MutexQueue deque(config.capacity);
+            r = runQueue(deque, producers, consumers, batch, config.items);
+        } else {
+            fprintf(stderr, "unknown queue %s\n", queue.c_str());
+            return 1;
+        }
+
+        double rate = config.items / r.seconds;
+        bool ok = r.sum == expected;
+        if (config.json) {
+            printf("{\"queue\":\"%s\",\"producers\":%d,\"consumers\":%d,\"batch\":%zu,\"capacity\":%zu,"
+                   "\"items\":%lu,\"seconds\":%.3f,\"items_per_sec\":%.0f,\"ok\":%s}\n",
+                   queue.c_str(), producers, consumers, batch, config.capacity,
+                   config.items, r.seconds, rate, ok ? "true" : "false");
+        } else {
+            printf("%-6s %9d %9d %6zu %14.0f %6s\n", queue.c_str(), producers, consumers, batch, rate, ok ? "ok" : "LOST");
+        }
+        fflush(stdout);
+    }
+    return 0;
+}